@@ -1,13 +1,59 @@
 #include <thread>
 #include <numeric>
 #include <vector>
+#include <new>
+#include <iterator>
+#include <type_traits>
+#include <algorithm>
+#include <functional>
+
+#ifdef __cpp_lib_hardware_interference_size
+constexpr std::size_t cache_line_size = std::hardware_destructive_interference_size;
+#else
+constexpr std::size_t cache_line_size = 64;
+#endif
+
+// each partial result on its own cache line: threads writing adjacent slots
+// of a std::vector<T> invalidate each other's line on every write (false sharing)
+template<typename T>
+struct alignas(cache_line_size) padded_result
+{
+    T value;
+};
 
 template<typename Iterator, typename T>
 struct accumulate_block
 {
     void operator() (Iterator first, Iterator last, T& result)
     {
-        result = std::accumulate(first, last, result);
+        typedef typename std::iterator_traits<Iterator>::iterator_category category;
+        if constexpr (std::is_arithmetic<T>::value && std::is_base_of<std::random_access_iterator_tag, category>::value)
+        {
+            // a single accumulator is a chain of dependent adds, the compiler can't reorder them.
+            // independent accumulators break the chain -> the loop can be vectorized and pipelined.
+            // for floating point the order of the additions changes, so the result can differ in the last bits
+            constexpr unsigned lanes = 8;
+            T acc[lanes] = {};
+            auto const length = last - first;
+            auto const vector_end = length - length % lanes;
+            for (std::ptrdiff_t i = 0; i < vector_end; i += lanes)
+            {
+                for (unsigned j = 0; j < lanes; ++j)
+                {
+                    acc[j] += first[i + j];
+                }
+            }
+            T sum = result;
+            for (unsigned j = 0; j < lanes; ++j)
+            {
+                sum += acc[j];
+            }
+            result = std::accumulate(first + vector_end, last, sum);
+        }
+        else
+        {
+            result = std::accumulate(first, last, result);
+        }
     }
 };
 
@@ -22,11 +68,11 @@ T parallel_accumulate(Iterator first, Iterator last, T init)
 
     unsigned long const min_per_thread = 25;
     unsigned long const max_threads = (length + min_per_thread - 1)/min_per_thread;
-    unsigned long const hardware_threads = std::threads::hardware_concurrency();
+    unsigned long const hardware_threads = std::thread::hardware_concurrency();
     unsigned long const num_threads = std::min(hardware_threads != 0 ? hardware_threads : 2, max_threads);  // running more threads than hardware can support: oversubscription
     unsigned long const block_size = length/num_threads;
 
-    std::vector<T> results(num_threads);
+    std::vector<padded_result<T> > results(num_threads, padded_result<T>{T()});
     std::vector<std::thread> threads(num_threads - 1);
 
     Iterator block_start = first;
@@ -37,19 +83,24 @@ T parallel_accumulate(Iterator first, Iterator last, T init)
         
         threads[i] = std::thread(
             accumulate_block<Iterator, T>(),
-            block_start, block_end, std::ref(result[i]));
+            block_start, block_end, std::ref(results[i].value));
         
         block_start = block_end;
     }
 
     accumulate_block<Iterator, T>()(
-        block_start, last, results[num_threads - 1]
-    )
+        block_start, last, results[num_threads - 1].value
+    );
 
     for(auto& entry : threads)
     {
         entry.join();
     }
 
-    return std::accumulate(results.begin(), results.end(), init),
-}
\ No newline at end of file
+    T result = init;
+    for(auto const& entry : results)
+    {
+        result = result + entry.value;
+    }
+    return result;
+}
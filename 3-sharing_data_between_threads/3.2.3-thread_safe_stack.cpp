@@ -71,4 +71,347 @@ public:
         std::lock_guard<std::mutex> lock(m);
         return data.empty();
     }
-};
\ No newline at end of file
+};
+
+/*
+lock-free stack (Treiber stack) with hazard pointers
+
+push: link the new node to the current head and CAS the head
+pop: CAS the head with head->next
+
+problem: between reading head and reading head->next another thread can pop
+and delete that node -> use after free; or pop it, delete it and push a new node
+with the same address -> CAS succeeds with a stale next (ABA).
+hazard pointers: before dereferencing head a thread publishes it in a global
+table "I'm using this node". A popped node is not deleted but retired, and
+it is deleted only when no hazard pointer refers to it. A node can't be
+reused while someone has it in a hazard pointer, so no ABA either.
+retired nodes are kept per thread and scanned in batches: the cost of
+reading the hazard table is paid once every many pops.
+exception safety as in thread_safe_stack: the data is held by a shared_ptr
+allocated in push, so once a node is unlinked returning it can't throw.
+Unlike thread_safe_stack, try_pop(T&)/pop(T&) need a T with a noexcept move
+assignment (checked at compile time, the shared_ptr versions take any T):
+the node is already unlinked when the value is assigned, it can't be put back.
+more threads than hazard pointer slots: the extra ones share a counter instead
+of a slot, and no retired node is deleted while one of them is popping.
+*/
+
+#include <array>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <new>
+#include <type_traits>
+
+unsigned const max_hazard_pointers = 100;
+
+struct hazard_pointer
+{
+    std::atomic<std::thread::id> id;
+    std::atomic<void*> pointer;
+};
+
+inline hazard_pointer hazard_pointers[max_hazard_pointers];
+
+// threads without a slot of their own currently dereferencing nodes
+inline std::atomic<unsigned> overflow_hazards{0};
+
+// owns one slot of the table for the lifetime of the thread
+class hp_owner
+{
+private:
+    hazard_pointer* hp;     // nullptr: table full, the thread uses overflow_hazards
+
+public:
+    hp_owner(hp_owner const&) = delete;
+    hp_owner& operator= (hp_owner const&) = delete;
+
+    hp_owner() : hp(nullptr)
+    {
+        for(unsigned i = 0; i < max_hazard_pointers; ++i)
+        {
+            std::thread::id old_id;
+            if(hazard_pointers[i].id.compare_exchange_strong(old_id, std::this_thread::get_id()))
+            {
+                hp = &hazard_pointers[i];
+                break;
+            }
+        }
+    }
+
+    std::atomic<void*>* get_pointer()
+    {
+        return hp ? &hp->pointer : nullptr;
+    }
+
+    ~hp_owner()
+    {
+        if(hp)
+        {
+            hp->pointer.store(nullptr);
+            hp->id.store(std::thread::id());
+        }
+    }
+};
+
+// nullptr if all the slots are taken
+inline std::atomic<void*>* get_hazard_pointer_for_current_thread()
+{
+    thread_local static hp_owner hazard;
+    return hazard.get_pointer();
+}
+
+inline bool outstanding_hazard_pointers_for(void* p)
+{
+    if(overflow_hazards.load() != 0)
+    {
+        return true;
+    }
+    for(unsigned i = 0; i < max_hazard_pointers; ++i)
+    {
+        if(hazard_pointers[i].pointer.load() == p)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct retired_node
+{
+    void* pointer;
+    void (*deleter)(void*);
+};
+
+// nodes retired by threads that exited while the nodes were still hazardous
+inline std::mutex orphan_mutex;
+inline std::vector<retired_node> orphan_nodes;
+
+class retired_list
+{
+private:
+    std::vector<retired_node> nodes;
+
+    // out of memory to keep it: wait until nobody can be reading it (hazard
+    // pointers are held for a few instructions) and delete it right away
+    static void reclaim_now(retired_node const& n)
+    {
+        while(outstanding_hazard_pointers_for(n.pointer))
+        {
+            std::this_thread::yield();
+        }
+        n.deleter(n.pointer);
+    }
+
+    // never throws: the hazard table is copied to the stack
+    void scan()
+    {
+        {
+            // adopt orphans, but never wait for it
+            std::unique_lock<std::mutex> lock(orphan_mutex, std::try_to_lock);
+            if(lock.owns_lock() && !orphan_nodes.empty())
+            {
+                try
+                {
+                    nodes.insert(nodes.end(), orphan_nodes.begin(), orphan_nodes.end());
+                    orphan_nodes.clear();
+                }
+                catch(std::bad_alloc const&)
+                {}  // left for the next scan
+            }
+        }
+        if(overflow_hazards.load() != 0)
+        {
+            return;     // some thread reads nodes without a hazard pointer
+        }
+        std::array<void*, max_hazard_pointers> hazards;
+        std::size_t count = 0;
+        for(unsigned i = 0; i < max_hazard_pointers; ++i)
+        {
+            if(void* const p = hazard_pointers[i].pointer.load())
+            {
+                hazards[count++] = p;
+            }
+        }
+        std::sort(hazards.begin(), hazards.begin() + count);
+        auto const still_hazardous = std::partition(nodes.begin(), nodes.end(),
+            [&](retired_node const& n){return std::binary_search(hazards.begin(), hazards.begin() + count, n.pointer);});
+        for(auto it = still_hazardous; it != nodes.end(); ++it)
+        {
+            it->deleter(it->pointer);
+        }
+        nodes.erase(still_hazardous, nodes.end());
+    }
+
+public:
+    ~retired_list()
+    {
+        scan();
+        if(!nodes.empty())
+        {
+            std::lock_guard<std::mutex> lock(orphan_mutex);
+            try
+            {
+                orphan_nodes.insert(orphan_nodes.end(), nodes.begin(), nodes.end());
+            }
+            catch(std::bad_alloc const&)
+            {
+                for(auto const& n : nodes)
+                {
+                    reclaim_now(n);
+                }
+            }
+        }
+    }
+
+    // never throws and never leaks the node
+    void add(void* pointer, void (*deleter)(void*))
+    {
+        retired_node const n{pointer, deleter};
+        try
+        {
+            nodes.push_back(n);
+        }
+        catch(std::bad_alloc const&)
+        {
+            reclaim_now(n);
+            return;
+        }
+        // batch: at least as many nodes as hazard pointers, so each scan frees something
+        if(nodes.size() >= 2 * max_hazard_pointers)
+        {
+            scan();
+        }
+    }
+};
+
+template<typename Node>
+void retire(Node* node)
+{
+    thread_local static retired_list retired;
+    retired.add(node, [](void* p){delete static_cast<Node*>(p);});
+}
+
+template <typename T>
+class lock_free_stack
+{
+private:
+    struct node
+    {
+        std::shared_ptr<T> data;   // allocated in push: popping never allocates
+        node* next;
+        explicit node(T&& data_) : data(std::make_shared<T>(std::move(data_))), next(nullptr) {}
+    };
+
+    std::atomic<node*> head;
+
+    // no hazard pointer slot left: the shared counter protects every node
+    node* pop_head_overflow()
+    {
+        overflow_hazards.fetch_add(1);  // before reading head: a scan that missed it can't see our node
+        node* old_head = head.load();
+        while(old_head && !head.compare_exchange_strong(old_head, old_head->next));
+        overflow_hazards.fetch_sub(1);
+        return old_head;
+    }
+
+    // exclusive owner of the returned node, it must be retired by the caller
+    node* pop_head()
+    {
+        std::atomic<void*>* const hp_slot = get_hazard_pointer_for_current_thread();
+        if(!hp_slot)
+        {
+            return pop_head_overflow();
+        }
+        std::atomic<void*>& hp = *hp_slot;
+        node* old_head = head.load();
+        do
+        {
+            // publish and re-check: head may have been popped (and deleted)
+            // before the hazard pointer was visible
+            node* temp;
+            do
+            {
+                temp = old_head;
+                hp.store(old_head);
+                old_head = head.load();
+            } while(old_head != temp);
+        } while(old_head && !head.compare_exchange_strong(old_head, old_head->next));
+        hp.store(nullptr);
+        return old_head;
+    }
+
+public:
+    lock_free_stack() : head(nullptr) {}
+    lock_free_stack(const lock_free_stack&) = delete;
+    lock_free_stack& operator= (const lock_free_stack&) = delete;
+
+    ~lock_free_stack()
+    {
+        // no other thread can access the stack anymore
+        node* n = head.load();
+        while(n)
+        {
+            node* const next = n->next;
+            delete n;
+            n = next;
+        }
+    }
+
+    void push(T new_value)
+    {
+        node* const new_node = new node(std::move(new_value));
+        new_node->next = head.load(std::memory_order_relaxed);
+        while(!head.compare_exchange_weak(new_node->next, new_node,
+            std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    // non-throwing versions
+    // a node can't be put back once unlinked, so the value is moved out only when
+    // that can't throw; otherwise use try_pop() returning a shared_ptr
+    bool try_pop(T& value)
+    {
+        static_assert(std::is_nothrow_move_assignable<T>::value,
+            "try_pop(T&) needs a non-throwing move assignment, use try_pop()");
+        std::shared_ptr<T> const res = try_pop();
+        if(!res)
+        {
+            return false;
+        }
+        value = std::move(*res);
+        return true;
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        node* const old_head = pop_head();
+        if(!old_head)
+        {
+            return std::shared_ptr<T>();
+        }
+        std::shared_ptr<T> res;
+        res.swap(old_head->data);   // other threads can only read next, data is ours
+        retire(old_head);
+        return res;
+    }
+
+    // same surface as thread_safe_stack: pop() throws on empty stack
+    std::shared_ptr<T> pop()
+    {
+        std::shared_ptr<T> res = try_pop();
+        if(!res) throw empty_stack();
+        return res;
+    }
+
+    void pop(T& value)
+    {
+        if(!try_pop(value)) throw empty_stack();
+    }
+
+    bool empty() const
+    {
+        return head.load() == nullptr;
+    }
+};
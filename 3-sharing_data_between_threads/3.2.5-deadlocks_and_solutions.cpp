@@ -76,6 +76,248 @@ public:
 
 thread_local unsigned long hierarchical_mutex::this_thread_hierarchy_value(ULONG_MAX);
 
+/*
+hierarchical_mutex pays a thread_local read/compare/write on every lock and
+unlock, also in production, and it can't see a problem between two mutexes with
+the same hierarchy value.
+-> policy based mutex:
+- no_lock_checking: it's just a std::mutex, nothing else is compiled in
+- lockdep_checking: every time a thread takes mutex B while holding A the edge
+  A -> B is added to a global lock-order graph. If B -> ... -> A is already in
+  the graph, two threads can deadlock even if it never happened yet: the cycle
+  is reported once, with the locks held by the thread, instead of throwing.
+  Hierarchy values are still checked, same levels are covered by the graph.
+checking is on in debug builds, or in release builds compiled with -DENABLE_LOCKDEP
+(e.g. canary builds)
+*/
+
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct no_lock_checking {};
+struct lockdep_checking {};
+
+template<typename CheckingPolicy>
+class checked_mutex;
+
+template<>
+class checked_mutex<no_lock_checking>
+{
+private:
+    std::mutex internal_mutex;
+
+public:
+    explicit checked_mutex(unsigned long /*hierarchy_value*/, char const* /*name*/ = "") {}
+
+    void lock() { internal_mutex.lock(); }
+    void unlock() { internal_mutex.unlock(); }
+    bool try_lock() { return internal_mutex.try_lock(); }
+};
+
+class lock_order_graph
+{
+private:
+    struct held_lock
+    {
+        unsigned long id;
+        unsigned long hierarchy_value;
+        char const* name;
+    };
+
+    std::mutex graph_mutex;
+    std::map<unsigned long, std::set<unsigned long> > edges;
+    std::map<unsigned long, std::string> names;
+    std::set<std::pair<unsigned long, unsigned long> > reported;
+    unsigned long next_id = 0;
+
+    static std::vector<held_lock>& held_locks()
+    {
+        thread_local std::vector<held_lock> held;
+        return held;
+    }
+
+    // graph_mutex must be held. visited: every node already explored, on the
+    // current path or not; a node that did not reach `to` once never will,
+    // so each mutex and each edge is looked at once: O(V + E) per check
+    bool path_exists(unsigned long from, unsigned long to, std::vector<unsigned long>& path,
+                     std::set<unsigned long>& visited)
+    {
+        path.push_back(from);
+        if(from == to)
+        {
+            return true;
+        }
+        visited.insert(from);
+        auto const it = edges.find(from);
+        if(it != edges.end())
+        {
+            for(unsigned long const next : it->second)
+            {
+                if(visited.find(next) == visited.end() && path_exists(next, to, path, visited))
+                {
+                    return true;
+                }
+            }
+        }
+        path.pop_back();
+        return false;
+    }
+
+    static std::string held_locks_description()
+    {
+        std::ostringstream out;
+        for(auto const& h : held_locks())
+        {
+            out << "    held: " << h.name << " (level " << h.hierarchy_value << ")\n";
+        }
+        return out.str();
+    }
+
+    void report(std::string const& what)
+    {
+        std::cerr << "lockdep: " << what << " in thread " << std::this_thread::get_id() << "\n"
+            << held_locks_description() << std::flush;
+    }
+
+public:
+    static lock_order_graph& instance()
+    {
+        static lock_order_graph graph;
+        return graph;
+    }
+
+    unsigned long add_mutex(char const* name)
+    {
+        std::lock_guard<std::mutex> lk(graph_mutex);
+        names[next_id] = name;
+        return next_id++;
+    }
+
+    void remove_mutex(unsigned long id)
+    {
+        std::lock_guard<std::mutex> lk(graph_mutex);
+        edges.erase(id);
+        for(auto& e : edges)
+        {
+            e.second.erase(id);
+        }
+        names.erase(id);
+    }
+
+    // before blocking: a deadlock is reported even if this lock() never returns
+    void before_lock(unsigned long id, unsigned long hierarchy_value, char const* name)
+    {
+        std::vector<held_lock> const& held = held_locks();
+        if(held.empty())
+        {
+            return;
+        }
+        std::lock_guard<std::mutex> lk(graph_mutex);
+        held_lock const& last = held.back();
+        if(hierarchy_value > last.hierarchy_value && reported.insert(std::make_pair(last.id, id)).second)
+        {
+            report(std::string("hierarchy violated acquiring ") + name);
+        }
+        for(auto const& h : held)
+        {
+            if(!edges[h.id].insert(id).second)
+            {
+                continue;   // edge already known and already checked
+            }
+            std::vector<unsigned long> path;
+            std::set<unsigned long> visited;
+            if(path_exists(id, h.id, path, visited) && reported.insert(std::make_pair(h.id, id)).second)
+            {
+                std::string cycle = names[h.id];
+                for(unsigned long const step : path)
+                {
+                    cycle += " -> " + names[step];
+                }
+                report("possible deadlock, lock order cycle " + cycle);
+            }
+        }
+    }
+
+    void after_lock(unsigned long id, unsigned long hierarchy_value, char const* name)
+    {
+        held_locks().push_back(held_lock{id, hierarchy_value, name});
+    }
+
+    void after_unlock(unsigned long id)
+    {
+        std::vector<held_lock>& held = held_locks();
+        // usually the last one, but unlock order doesn't have to be the reverse
+        for(auto it = held.rbegin(); it != held.rend(); ++it)
+        {
+            if(it->id == id)
+            {
+                held.erase(std::next(it).base());
+                return;
+            }
+        }
+    }
+};
+
+template<>
+class checked_mutex<lockdep_checking>
+{
+private:
+    std::mutex internal_mutex;
+    unsigned long const hierarchy_value;
+    char const* const name;
+    unsigned long const id;
+
+public:
+    explicit checked_mutex(unsigned long hierarchy_value_, char const* name_ = "unnamed mutex") :
+        hierarchy_value(hierarchy_value_),
+        name(name_),
+        id(lock_order_graph::instance().add_mutex(name_))
+    {}
+
+    ~checked_mutex()
+    {
+        lock_order_graph::instance().remove_mutex(id);
+    }
+
+    void lock()
+    {
+        lock_order_graph::instance().before_lock(id, hierarchy_value, name);
+        internal_mutex.lock();
+        lock_order_graph::instance().after_lock(id, hierarchy_value, name);
+    }
+
+    void unlock()
+    {
+        lock_order_graph::instance().after_unlock(id);
+        internal_mutex.unlock();
+    }
+
+    bool try_lock()
+    {
+        // try_lock can't deadlock: no edge, just track it as held
+        if(!internal_mutex.try_lock())
+        {
+            return false;
+        }
+        lock_order_graph::instance().after_lock(id, hierarchy_value, name);
+        return true;
+    }
+};
+
+#if defined(ENABLE_LOCKDEP) || !defined(NDEBUG)
+typedef checked_mutex<lockdep_checking> ordered_mutex;
+#else
+typedef checked_mutex<no_lock_checking> ordered_mutex;
+#endif
+
+// ordered_mutex high_level_mutex(10000, "high_level_mutex");
+// ordered_mutex low_level_mutex(5000, "low_level_mutex");
+
 /*
 std::unique_lock useful to get some flexibility regarding lock ownership
 lock ownership can be moved -> lock released in the correct branch,
@@ -132,24 +374,970 @@ reader threads and few writer threads to do only the necessary blocking
 #include <mutex>
 #include <shared_mutex>
 class dns_entry;
-class dns_cache
+// the mutex is a parameter so that any shared mutex type can be used (see distributed_shared_mutex)
+template<typename SharedMutex>
+class basic_dns_cache
 {
     std::map<std::string,dns_entry> entries;
-    mutable std::shared_mutex entry_mutex;
+    mutable SharedMutex entry_mutex;
 public:
     dns_entry find_entry(std::string const& domain) const
     {
-        std::shared_lock<std::shared_mutex> lk(entry_mutex);
-        std::map<std::string,dns_entry>::const_iterator const it=entries.find(domain);
+        std::shared_lock<SharedMutex> lk(entry_mutex);
+        typename std::map<std::string,dns_entry>::const_iterator const it=entries.find(domain);
         return (it==entries.end())? dns_entry():it->second;
     }
     void update_or_add_entry(std::string const& domain, dns_entry const& dns_details)
     {
-        std::lock_guard<std::shared_mutex> lk(entry_mutex);
+        std::lock_guard<SharedMutex> lk(entry_mutex);
         entries[domain]=dns_details;
     }
 };
 
+typedef basic_dns_cache<std::shared_mutex> dns_cache;
+
+/*
+sharded dns_cache
+with one std::map and one std::shared_mutex every lookup is O(log n) string
+compares and every update blocks all the readers.
+split the entries in N shards (N power of two) chosen by the hash of the domain:
+- each shard has its own lock, an update blocks only 1/N of the readers
+- each shard is an open addressing table (linear probing) in a vector,
+  lookups touch contiguous memory and no node allocations
+- the hash is computed once per call and stored in the slot: probing compares
+  hashes and compares strings only when hashes are equal
+same find_entry / update_or_add_entry interface as dns_cache, same mutex parameter
+*/
+
+#include <vector>
+#include <functional>
+#include <cstddef>
+
+template<typename SharedMutex>
+class basic_sharded_dns_cache
+{
+private:
+    struct slot
+    {
+        std::size_t hash = 0;
+        bool used = false;
+        std::string domain;
+        dns_entry details;
+    };
+
+    struct alignas(64) shard   // shards don't share cache lines
+    {
+        mutable SharedMutex mutex;
+        std::vector<slot> slots = std::vector<slot>(16); // size always power of two
+        std::size_t count = 0;
+
+        // index of the slot holding domain, or of the empty slot where it would go
+        std::size_t probe(std::size_t hash, std::string const& domain) const
+        {
+            std::size_t const mask = slots.size() - 1;
+            std::size_t i = hash & mask;
+            while(slots[i].used && (slots[i].hash != hash || slots[i].domain != domain))
+            {
+                i = (i + 1) & mask;
+            }
+            return i;
+        }
+
+        void grow()
+        {
+            std::vector<slot> old(slots.size() * 2);
+            old.swap(slots);
+            for(auto& entry : old)
+            {
+                if(entry.used)
+                {
+                    slots[probe(entry.hash, entry.domain)] = std::move(entry);
+                }
+            }
+        }
+    };
+
+    unsigned const shard_bits;
+    std::vector<shard> shards;
+
+    shard& shard_for(std::size_t hash)
+    {
+        // top bits choose the shard, low bits the slot inside it: the two are independent
+        return shards[shard_bits ? hash >> (sizeof(std::size_t) * 8 - shard_bits) : 0];
+    }
+
+    shard const& shard_for(std::size_t hash) const
+    {
+        return const_cast<basic_sharded_dns_cache*>(this)->shard_for(hash);
+    }
+
+    static std::size_t hash_of(std::string const& domain)
+    {
+        // mix the bits: std::hash can be weak in the top bits used for the shard
+        std::size_t h = std::hash<std::string>()(domain);
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+public:
+    explicit basic_sharded_dns_cache(unsigned shard_bits_ = 6) :
+        shard_bits(shard_bits_),
+        shards(std::size_t(1) << shard_bits_)
+    {}
+
+    dns_entry find_entry(std::string const& domain) const
+    {
+        std::size_t const hash = hash_of(domain);
+        shard const& s = shard_for(hash);
+        std::shared_lock<SharedMutex> lk(s.mutex);
+        slot const& entry = s.slots[s.probe(hash, domain)];
+        return entry.used ? entry.details : dns_entry();
+    }
+
+    void update_or_add_entry(std::string const& domain, dns_entry const& dns_details)
+    {
+        std::size_t const hash = hash_of(domain);
+        shard& s = shard_for(hash);
+        std::lock_guard<SharedMutex> lk(s.mutex);
+        std::size_t i = s.probe(hash, domain);
+        if(!s.slots[i].used)
+        {
+            if(2 * (s.count + 1) > s.slots.size()) // keep load factor <= 0.5, probes stay short
+            {
+                s.grow();
+                i = s.probe(hash, domain);
+            }
+            s.slots[i].used = true;
+            s.slots[i].hash = hash;
+            s.slots[i].domain = domain;
+            ++s.count;
+        }
+        s.slots[i].details = dns_details;
+    }
+};
+
+typedef basic_sharded_dns_cache<std::shared_mutex> sharded_dns_cache;
+
+/*
+read-mostly dns_cache: RCU style snapshots
+even std::shared_lock writes to the shared_mutex (reader count), so with many
+readers that cache line bounces between all the cores.
+readers:
+- never lock, load a pointer to an immutable snapshot of the whole table
+- before that they write the current epoch in their own reader slot, on their
+  own cache line: nobody else writes there, so no shared writes
+- past max_readers threads, the extra ones share an overflow counter (slower,
+  and reclamation waits for it to drop to 0) instead of failing
+- read sections nest: only the outermost one writes the slot
+writers:
+- copy the current snapshot, apply a batch of updates, publish the new pointer
+- the old snapshot can't be deleted right away, some reader may still use it:
+  it is retired with the epoch of the publication and deleted when every
+  reader slot is either idle (0) or has seen a later epoch
+copying the table makes a publication O(n), so updates are batched:
+update_or_add_entry only queues the update, a flusher thread publishes all the
+queued updates in one snapshot when max_batch are queued or the oldest one has
+waited max_delay. The copy is paid once per batch and off the caller's thread.
+An update is visible to readers once published, flush() publishes right away.
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include <memory>
+#include <atomic>
+#include <thread>
+
+class rcu_domain
+{
+private:
+    static unsigned const max_readers = 128;
+
+    struct alignas(64) reader_slot
+    {
+        std::atomic<std::thread::id> owner;
+        std::atomic<unsigned long> epoch{0}; // 0 -> not inside a read section
+    };
+
+    reader_slot readers[max_readers];
+    std::atomic<unsigned long> global_epoch{1};
+    // threads beyond max_readers share this counter instead of a slot: it has
+    // no epoch, so nothing is reclaimed while one of them is in a read section
+    alignas(64) std::atomic<unsigned long> overflow_readers{0};
+
+    // claims one slot for the lifetime of the thread, like hp_owner for hazard pointers
+    class slot_owner
+    {
+        reader_slot* slot;  // nullptr: all taken, the thread uses overflow_readers
+    public:
+        unsigned depth;     // nested read sections: only the outermost one publishes
+
+        explicit slot_owner(rcu_domain& domain) : slot(nullptr), depth(0)
+        {
+            for(unsigned i = 0; i < max_readers; ++i)
+            {
+                std::thread::id old_id;
+                if(domain.readers[i].owner.compare_exchange_strong(old_id, std::this_thread::get_id()))
+                {
+                    slot = &domain.readers[i];
+                    break;
+                }
+            }
+        }
+        ~slot_owner()
+        {
+            if(slot)
+            {
+                slot->epoch.store(0);
+                slot->owner.store(std::thread::id());
+            }
+        }
+        reader_slot* get() { return slot; }
+    };
+
+    slot_owner& owner_for_current_thread()
+    {
+        thread_local static slot_owner owner(*this);
+        return owner;
+    }
+
+public:
+    static rcu_domain& instance()
+    {
+        static rcu_domain domain;
+        return domain;
+    }
+
+    // read sections can nest: the inner ones run under the epoch of the outermost
+    void read_lock()
+    {
+        slot_owner& owner = owner_for_current_thread();
+        if(owner.depth++ != 0)
+        {
+            return;
+        }
+        if(reader_slot* const slot = owner.get())
+        {
+            slot->epoch.store(global_epoch.load());
+        }
+        else
+        {
+            overflow_readers.fetch_add(1);
+        }
+    }
+
+    void read_unlock()
+    {
+        slot_owner& owner = owner_for_current_thread();
+        if(--owner.depth != 0)
+        {
+            return;
+        }
+        if(reader_slot* const slot = owner.get())
+        {
+            slot->epoch.store(0, std::memory_order_release);
+        }
+        else
+        {
+            overflow_readers.fetch_sub(1, std::memory_order_release);
+        }
+    }
+
+    // call after publishing a new pointer, returns the epoch to retire the old one with
+    unsigned long advance()
+    {
+        return global_epoch.fetch_add(1);
+    }
+
+    // true if no reader can still see what was retired at retire_epoch
+    bool quiescent(unsigned long retire_epoch) const
+    {
+        if(overflow_readers.load() != 0)
+        {
+            return false;
+        }
+        for(unsigned i = 0; i < max_readers; ++i)
+        {
+            unsigned long const e = readers[i].epoch.load();
+            if(e != 0 && e <= retire_epoch)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+class rcu_read_guard
+{
+public:
+    rcu_read_guard() { rcu_domain::instance().read_lock(); }
+    ~rcu_read_guard() { rcu_domain::instance().read_unlock(); }
+    rcu_read_guard(rcu_read_guard const&) = delete;
+    rcu_read_guard& operator= (rcu_read_guard const&) = delete;
+};
+
+class snapshot_dns_cache
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+private:
+    typedef std::unordered_map<std::string, dns_entry> snapshot;
+
+    std::atomic<snapshot const*> current;
+    std::mutex writer_mutex;   // writers are serialized, readers never take it
+    std::vector<std::pair<unsigned long, std::unique_ptr<snapshot const> > > retired;
+
+    std::size_t const max_batch;
+    clock::duration const max_delay;
+    std::mutex pending_mutex;
+    std::condition_variable pending_cond;
+    std::vector<std::pair<std::string, dns_entry> > pending;   // in call order
+    clock::time_point oldest_pending;
+    bool stopping;
+    std::thread flusher;
+
+    void reclaim()
+    {
+        rcu_domain& domain = rcu_domain::instance();
+        auto const still_visible = std::partition(retired.begin(), retired.end(),
+            [&](auto const& r){return !domain.quiescent(r.first);});
+        retired.erase(still_visible, retired.end());    // deletes the snapshots
+    }
+
+    void flush_thread()
+    {
+        std::unique_lock<std::mutex> lk(pending_mutex);
+        while(!stopping)
+        {
+            if(pending.empty())
+            {
+                pending_cond.wait(lk);
+            }
+            else if(pending.size() < max_batch && clock::now() < oldest_pending + max_delay)
+            {
+                pending_cond.wait_until(lk, oldest_pending + max_delay);
+            }
+            else
+            {
+                lk.unlock();
+                flush();
+                lk.lock();
+            }
+        }
+    }
+
+public:
+    explicit snapshot_dns_cache(std::size_t max_batch_ = 1024,
+        clock::duration max_delay_ = std::chrono::milliseconds(50)) :
+        current(new snapshot),
+        max_batch(max_batch_),
+        max_delay(max_delay_),
+        stopping(false),
+        flusher(&snapshot_dns_cache::flush_thread, this)
+    {}
+    snapshot_dns_cache(snapshot_dns_cache const&) = delete;
+    snapshot_dns_cache& operator= (snapshot_dns_cache const&) = delete;
+
+    ~snapshot_dns_cache()
+    {
+        {
+            std::lock_guard<std::mutex> lk(pending_mutex);
+            stopping = true;
+        }
+        pending_cond.notify_one();
+        flusher.join();
+        delete current.load();
+    }
+
+    dns_entry find_entry(std::string const& domain) const
+    {
+        rcu_read_guard guard;
+        snapshot const* const entries = current.load();
+        snapshot::const_iterator const it = entries->find(domain);
+        return (it == entries->end()) ? dns_entry() : it->second;
+    }
+
+    // publishes every queued update in one new snapshot
+    void flush()
+    {
+        std::lock_guard<std::mutex> lk(writer_mutex);   // batches are taken and published in order
+        std::vector<std::pair<std::string, dns_entry> > batch;
+        {
+            std::lock_guard<std::mutex> pending_lk(pending_mutex);
+            batch.swap(pending);
+        }
+        if(batch.empty())
+        {
+            return;
+        }
+        std::unique_ptr<snapshot> next(new snapshot(*current.load())); // copy on write
+        for(auto& update : batch)
+        {
+            (*next)[std::move(update.first)] = std::move(update.second);
+        }
+        snapshot const* const old = current.exchange(next.release());
+        retired.emplace_back(rcu_domain::instance().advance(), std::unique_ptr<snapshot const>(old));
+        reclaim();
+    }
+
+    // queued, visible after the next flush
+    void update_or_add_entry(std::string const& domain, dns_entry const& dns_details)
+    {
+        std::lock_guard<std::mutex> lk(pending_mutex);
+        pending.emplace_back(domain, dns_details);
+        if(pending.size() == 1)
+        {
+            oldest_pending = clock::now();
+            pending_cond.notify_one();  // starts the max_delay countdown
+        }
+        else if(pending.size() == max_batch)
+        {
+            pending_cond.notify_one();
+        }
+    }
+
+    template<typename Iterator> // iterator over pair<std::string, dns_entry>
+    void update_or_add_entries(Iterator first, Iterator last)
+    {
+        {
+            std::lock_guard<std::mutex> lk(pending_mutex);
+            pending.insert(pending.end(), first, last);
+        }
+        flush();    // a batch already: published right away, with whatever was queued before
+    }
+};
+
+/*
+dns_cache with TTL and background refresh
+in dns_cache entries never expire, and on a miss the caller gets dns_entry()
+and has to resolve the name itself, on the request path.
+- each entry has an expiry time, checked when it is read (lazy expiry)
+- expired but within stale_window: the old value is returned right away and a
+  refresh is queued (stale-while-revalidate)
+- miss or too old: resolve now, but concurrent misses for the same domain
+  wait for a single lookup (shared_future) instead of all resolving
+- a background thread renews entries used recently before they expire,
+  so hot names never go stale, and evicts the ones nobody read: an entry
+  past expires + stale_window can't be served anymore, so the map holds only
+  the names looked up within about ttl + stale_window
+*/
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <iostream>
+#include <set>
+#include <stdexcept>
+#include <type_traits>
+
+template<typename SharedMutex>
+class basic_refreshing_dns_cache
+{
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<dns_entry(std::string const&)> resolver_type;
+
+private:
+    struct cached_entry
+    {
+        dns_entry details;
+        clock::time_point expires;
+        mutable std::atomic<clock::rep> last_used; // updated under shared lock
+        cached_entry(dns_entry const& details_, clock::time_point expires_) :
+            details(details_), expires(expires_), last_used(clock::now().time_since_epoch().count())
+        {}
+    };
+
+    resolver_type const resolver;
+    clock::duration const ttl;
+    clock::duration const stale_window;
+    clock::duration const refresh_ahead;
+
+    std::map<std::string, cached_entry> entries;
+    mutable SharedMutex entry_mutex;
+
+    // lookups in progress, shared by the threads missing on the same domain
+    std::mutex in_flight_mutex;
+    std::map<std::string, std::shared_future<dns_entry> > in_flight;
+
+    std::mutex refresh_mutex;
+    std::condition_variable refresh_cond;
+    std::set<std::string> refresh_queue;    // set: a domain is queued only once
+    bool stopping;
+    std::thread refresher;
+
+    // the refresher wakes up every refresh_ahead / 2: zero would make it spin
+    static clock::duration checked_refresh_ahead(clock::duration refresh_ahead_)
+    {
+        if(refresh_ahead_ < std::chrono::milliseconds(1))
+        {
+            throw std::invalid_argument("refresh_ahead must be at least 1ms");
+        }
+        return refresh_ahead_;
+    }
+
+    dns_entry resolve_coalesced(std::string const& domain)
+    {
+        std::promise<dns_entry> p;
+        std::shared_future<dns_entry> result;
+        bool owner = false;
+        {
+            std::lock_guard<std::mutex> lk(in_flight_mutex);
+            auto const it = in_flight.find(domain);
+            if(it != in_flight.end())
+            {
+                result = it->second;
+            }
+            else
+            {
+                result = p.get_future().share();
+                in_flight.emplace(domain, result);
+                owner = true;
+            }
+        }
+        if(owner)   // only one thread per domain calls the resolver
+        {
+            try
+            {
+                dns_entry const details = resolver(domain);
+                update_or_add_entry(domain, details);
+                p.set_value(details);
+            }
+            catch(...)
+            {
+                p.set_exception(std::current_exception());
+            }
+            std::lock_guard<std::mutex> lk(in_flight_mutex);
+            in_flight.erase(domain);
+        }
+        return result.get();
+    }
+
+    void queue_refresh(std::string const& domain)
+    {
+        {
+            std::lock_guard<std::mutex> lk(refresh_mutex);
+            refresh_queue.insert(domain);
+        }
+        refresh_cond.notify_one();
+    }
+
+    // entries close to expiry and used within the last ttl
+    std::vector<std::string> hot_entries_to_renew()
+    {
+        std::vector<std::string> result;
+        clock::time_point const now = clock::now();
+        std::shared_lock<SharedMutex> lk(entry_mutex);
+        for(auto const& entry : entries)
+        {
+            clock::time_point const last_used(clock::duration(entry.second.last_used.load(std::memory_order_relaxed)));
+            if(entry.second.expires - now < refresh_ahead && now - last_used < ttl)
+            {
+                result.push_back(entry.first);
+            }
+        }
+        return result;
+    }
+
+    // hot entries are renewed before expiry, so an entry past its stale window
+    // wasn't read for at least ttl: a lookup would resolve it again anyway
+    void evict_dead_entries()
+    {
+        std::vector<std::string> dead;
+        clock::time_point const now = clock::now();
+        {
+            std::shared_lock<SharedMutex> lk(entry_mutex);  // scan without blocking the readers
+            for(auto const& entry : entries)
+            {
+                if(now >= entry.second.expires + stale_window)
+                {
+                    dead.push_back(entry.first);
+                }
+            }
+        }
+        if(dead.empty())
+        {
+            return;
+        }
+        std::lock_guard<SharedMutex> lk(entry_mutex);
+        for(auto const& domain : dead)
+        {
+            auto const it = entries.find(domain);
+            if(it != entries.end() && now >= it->second.expires + stale_window)   // not renewed meanwhile
+            {
+                entries.erase(it);
+            }
+        }
+    }
+
+    void refresh_thread()
+    {
+        std::unique_lock<std::mutex> lk(refresh_mutex);
+        while(!stopping)
+        {
+            refresh_cond.wait_for(lk, refresh_ahead / 2, [this]{return stopping || !refresh_queue.empty();});
+            if(stopping)
+            {
+                break;
+            }
+            std::set<std::string> domains;
+            domains.swap(refresh_queue);
+            lk.unlock(); // resolve without holding refresh_mutex
+            for(auto const& domain : hot_entries_to_renew())
+            {
+                domains.insert(domain);
+            }
+            for(auto const& domain : domains)
+            {
+                try
+                {
+                    resolve_coalesced(domain);
+                }
+                catch(...)
+                {}  // keep serving the stale value, retried on the next pass
+            }
+            evict_dead_entries();
+            lk.lock();
+        }
+    }
+
+public:
+    basic_refreshing_dns_cache(resolver_type resolver_,
+        clock::duration ttl_ = std::chrono::seconds(300),
+        clock::duration stale_window_ = std::chrono::seconds(30),
+        clock::duration refresh_ahead_ = std::chrono::seconds(10)) :
+        resolver(std::move(resolver_)),
+        ttl(ttl_),
+        stale_window(stale_window_),
+        refresh_ahead(checked_refresh_ahead(refresh_ahead_)),
+        stopping(false),
+        refresher(&basic_refreshing_dns_cache::refresh_thread, this)
+    {}
+
+    ~basic_refreshing_dns_cache()
+    {
+        {
+            std::lock_guard<std::mutex> lk(refresh_mutex);
+            stopping = true;
+        }
+        refresh_cond.notify_one();
+        refresher.join();
+    }
+
+    dns_entry find_entry(std::string const& domain)
+    {
+        clock::time_point const now = clock::now();
+        {
+            std::shared_lock<SharedMutex> lk(entry_mutex);
+            auto const it = entries.find(domain);
+            if(it != entries.end())
+            {
+                it->second.last_used.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+                if(now < it->second.expires)
+                {
+                    return it->second.details;
+                }
+                if(now < it->second.expires + stale_window)
+                {
+                    dns_entry const stale = it->second.details;
+                    lk.unlock();
+                    queue_refresh(domain);
+                    return stale;
+                }
+            }
+        }
+        return resolve_coalesced(domain);
+    }
+
+    void update_or_add_entry(std::string const& domain, dns_entry const& dns_details)
+    {
+        clock::time_point const expires = clock::now() + ttl;
+        std::lock_guard<SharedMutex> lk(entry_mutex);
+        auto const it = entries.find(domain);
+        if(it == entries.end())
+        {
+            entries.emplace(std::piecewise_construct,
+                std::forward_as_tuple(domain), std::forward_as_tuple(dns_details, expires));
+        }
+        else
+        {
+            it->second.details = dns_details;
+            it->second.expires = expires;
+        }
+    }
+
+    std::size_t size() const
+    {
+        std::shared_lock<SharedMutex> lk(entry_mutex);
+        return entries.size();
+    }
+};
+
+typedef basic_refreshing_dns_cache<std::shared_mutex> refreshing_dns_cache;
+
+// checks coalescing, stale-while-revalidate and eviction with a stub resolver
+// counting its calls, e.g. check_refreshing_dns_cache<refreshing_dns_cache>()
+template<typename Cache>
+bool check_refreshing_dns_cache()
+{
+    typedef std::invoke_result_t<typename Cache::resolver_type, std::string const&> entry_type;
+    using std::chrono::milliseconds;
+    bool ok = true;
+
+    // 8 concurrent misses on one domain: a single resolver call
+    {
+        std::atomic<unsigned> calls(0);
+        Cache cache([&](std::string const&) {
+            ++calls;
+            std::this_thread::sleep_for(milliseconds(100));
+            return entry_type();
+        });
+        std::vector<std::thread> readers;
+        for(unsigned i = 0; i < 8; ++i)
+        {
+            readers.push_back(std::thread([&]{ cache.find_entry("example.com"); }));
+        }
+        for(auto& r : readers)
+        {
+            r.join();
+        }
+        std::cout << "coalescing: " << calls << " resolver call(s) for 8 misses" << std::endl;
+        ok = ok && calls == 1;
+    }
+
+    // expired but within stale_window: served at once while the resolver is blocked
+    {
+        std::atomic<unsigned> calls(0);
+        std::atomic<bool> release(false);
+        Cache cache([&](std::string const&) {
+            if(calls++ != 0)
+            {
+                while(!release)
+                {
+                    std::this_thread::sleep_for(milliseconds(1));
+                }
+            }
+            return entry_type();
+        }, milliseconds(50), std::chrono::seconds(10), milliseconds(10));
+        cache.find_entry("example.com");
+        std::this_thread::sleep_for(milliseconds(100));
+        auto const start = Cache::clock::now();
+        cache.find_entry("example.com");    // would hang here if it waited for the refresh
+        bool const served_stale = Cache::clock::now() - start < milliseconds(20);
+        release = true;
+        for(unsigned i = 0; i < 100 && calls < 2; ++i)
+        {
+            std::this_thread::sleep_for(milliseconds(10));
+        }
+        std::cout << "stale-while-revalidate: stale value " << (served_stale ? "served" : "not served")
+            << ", " << calls << " resolver call(s)" << std::endl;
+        ok = ok && served_stale && calls >= 2;
+    }
+
+    // not read again: evicted once past its stale window
+    {
+        Cache cache([](std::string const&) { return entry_type(); },
+            milliseconds(20), milliseconds(20), milliseconds(10));
+        cache.find_entry("example.com");
+        std::this_thread::sleep_for(milliseconds(200));
+        std::cout << "eviction: " << cache.size() << " entry(ies) left" << std::endl;
+        ok = ok && cache.size() == 0;
+    }
+    return ok;
+}
+
+/*
+scalable reader-writer lock
+std::shared_mutex keeps a single reader counter: every lock_shared/unlock_shared
+of every thread writes the same cache line, and beyond a few cores readers
+spend their time moving that line around.
+distributed_shared_mutex spreads the reader counter over slots, one cache line
+each, a thread always uses the same slot:
+- reader: increment own slot, then check the writer flag; if a writer is
+  there, undo and wait for the writer to finish
+- writer: take the writer mutex (one writer at a time), raise the flag, then
+  wait for every slot to drain to zero
+readers no longer share anything but a flag that is only read while there are
+no writers. The price is paid by writers, which scan all the slots.
+Same interface as std::shared_mutex, so it works with std::shared_lock,
+std::lock_guard and std::unique_lock: code guarded by a shared_mutex can opt in
+just by changing the mutex type (the dns caches above take it as a parameter).
+*/
+
+#include <chrono>
+#include <iostream>
+
+class distributed_shared_mutex
+{
+private:
+    static unsigned const reader_slots = 64;
+
+    struct alignas(64) slot
+    {
+        std::atomic<unsigned> readers{0};
+    };
+
+    slot slots[reader_slots];
+    alignas(64) std::atomic<bool> writer{false};
+    std::mutex writer_mutex;
+
+    static unsigned slot_index()
+    {
+        // threads get consecutive indexes, so up to reader_slots threads never share a slot
+        static std::atomic<unsigned> next_index{0};
+        thread_local unsigned const index = next_index.fetch_add(1) % reader_slots;
+        return index;
+    }
+
+    void wait_for_readers()
+    {
+        for(auto& s : slots)
+        {
+            for(unsigned n = s.readers.load(); n != 0; n = s.readers.load())
+            {
+                s.readers.wait(n);  // readers notify on the way out when a writer is present
+            }
+        }
+    }
+
+public:
+    distributed_shared_mutex() = default;
+    distributed_shared_mutex(distributed_shared_mutex const&) = delete;
+    distributed_shared_mutex& operator= (distributed_shared_mutex const&) = delete;
+
+    void lock()
+    {
+        writer_mutex.lock();
+        writer.store(true);     // new readers back off from now on
+        wait_for_readers();
+    }
+
+    bool try_lock()
+    {
+        if(!writer_mutex.try_lock())
+        {
+            return false;
+        }
+        writer.store(true);
+        for(auto& s : slots)
+        {
+            if(s.readers.load() != 0)
+            {
+                unlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void unlock()
+    {
+        writer.store(false);
+        writer.notify_all();
+        writer_mutex.unlock();
+    }
+
+    void lock_shared()
+    {
+        slot& s = slots[slot_index()];
+        for(;;)
+        {
+            s.readers.fetch_add(1);
+            if(!writer.load())
+            {
+                return;
+            }
+            s.readers.fetch_sub(1);
+            s.readers.notify_all();     // the writer may be waiting for this slot
+            writer.wait(true);
+        }
+    }
+
+    bool try_lock_shared()
+    {
+        slot& s = slots[slot_index()];
+        s.readers.fetch_add(1);
+        if(!writer.load())
+        {
+            return true;
+        }
+        s.readers.fetch_sub(1);
+        s.readers.notify_all();
+        return false;
+    }
+
+    void unlock_shared()
+    {
+        slot& s = slots[slot_index()];
+        s.readers.fetch_sub(1);
+        if(writer.load())   // syscall only if a writer is draining the slots
+        {
+            s.readers.notify_all();
+        }
+    }
+};
+
+typedef basic_dns_cache<distributed_shared_mutex> scalable_dns_cache;
+typedef basic_sharded_dns_cache<distributed_shared_mutex> scalable_sharded_dns_cache;
+typedef basic_refreshing_dns_cache<distributed_shared_mutex> scalable_refreshing_dns_cache;
+
+// read throughput (lock_shared + read + unlock_shared per second) with num_threads readers
+template<typename SharedMutex>
+double reads_per_second(unsigned num_threads, std::chrono::milliseconds duration)
+{
+    SharedMutex m;
+    int shared_value = 42;
+    std::atomic<bool> start(false), stop(false);
+    std::vector<unsigned long> counts(num_threads * 16);   // 16 apart: counters don't share cache lines
+    std::vector<std::thread> threads;
+    for(unsigned i = 0; i < num_threads; ++i)
+    {
+        threads.push_back(std::thread([&, i]{
+            unsigned long n = 0;
+            while(!start.load()) {}
+            while(!stop.load(std::memory_order_relaxed))
+            {
+                std::shared_lock<SharedMutex> lk(m);
+                volatile int v = shared_value;
+                (void)v;
+                ++n;
+            }
+            counts[i * 16] = n;
+        }));
+    }
+    start = true;
+    std::this_thread::sleep_for(duration);
+    stop = true;
+    unsigned long total = 0;
+    for(unsigned i = 0; i < num_threads; ++i)
+    {
+        threads[i].join();
+        total += counts[i * 16];
+    }
+    return total / std::chrono::duration<double>(duration).count();
+}
+
+void compare_read_scaling()
+{
+    unsigned const hardware_threads = std::thread::hardware_concurrency();
+    unsigned const max_threads = hardware_threads != 0 ? hardware_threads : 2;
+    std::chrono::milliseconds const duration(500);
+    std::cout << "threads  std::shared_mutex  distributed_shared_mutex  (reads/s)" << std::endl;
+    for(unsigned n = 1; n <= max_threads; n *= 2)
+    {
+        std::cout << n << "  "
+            << reads_per_second<std::shared_mutex>(n, duration) << "  "
+            << reads_per_second<distributed_shared_mutex>(n, duration) << std::endl;
+    }
+}
+
 /*
 recursive locking is usually symptom of bad design 
 */
\ No newline at end of file
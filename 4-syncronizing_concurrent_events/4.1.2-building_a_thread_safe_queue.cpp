@@ -27,6 +27,7 @@ private:
     std::mutex mut;
     std::queue<T> data_queue;
     std::condition_variable data_cond;
+    std::size_t waiting_consumers = 0; // threads blocked in data_cond, protected by mut
 public:
     void push(T new_variable)
     {
@@ -40,11 +41,84 @@ public:
     void wait_and_pop(T& variable)
     {
         std::unique_lock<std::mutex> lock(mut);
+        ++waiting_consumers;
         data_cond.wait(lock, [this]{return !data_queue.empty();});
+        --waiting_consumers;
         variable = data_queue.front();
         data_queue.pop();
         lock.unlock() // not necessary, released as soon as it goes out of scope
     }
+
+    // batched versions: one lock acquisition for many elements
+
+    template<typename Iterator>
+    void push_range(Iterator first, Iterator last)
+    {
+        std::size_t pushed = 0;
+        std::size_t waiting;
+        {
+            std::lock_guard<std::mutex> lock(mut);
+            for(; first != last; ++first, ++pushed)
+            {
+                data_queue.push(*first);
+            }
+            waiting = waiting_consumers;
+        }
+        notify(pushed, waiting);
+    }
+
+    // pops up to max_n elements without blocking, returns how many
+    template<typename OutputIterator>
+    std::size_t pop_bulk(OutputIterator out, std::size_t max_n)
+    {
+        std::lock_guard<std::mutex> lock(mut);
+        return move_out(out, max_n);
+    }
+
+    // blocks until at least one element is available, then pops up to max_n
+    template<typename OutputIterator>
+    std::size_t wait_and_pop_bulk(OutputIterator out, std::size_t max_n)
+    {
+        std::unique_lock<std::mutex> lock(mut);
+        ++waiting_consumers;
+        data_cond.wait(lock, [this]{return !data_queue.empty();});
+        --waiting_consumers;
+        return move_out(out, max_n);
+    }
+
+private:
+    template<typename OutputIterator>
+    std::size_t move_out(OutputIterator out, std::size_t max_n)
+    {
+        std::size_t n = 0;
+        for(; n < max_n && !data_queue.empty(); ++n)
+        {
+            *out++ = std::move(data_queue.front());
+            data_queue.pop();
+        }
+        return n;
+    }
+
+    // wake as many consumers as items pushed: not one wakeup per element,
+    // and not all the waiting threads when there are only a few elements
+    void notify(std::size_t pushed, std::size_t waiting)
+    {
+        if(!pushed || !waiting)
+        {
+            return;
+        }
+        if(pushed >= waiting)
+        {
+            data_cond.notify_all();
+        }
+        else
+        {
+            for(std::size_t i = 0; i < pushed; ++i)
+            {
+                data_cond.notify_one();
+            }
+        }
+    }
 };
 
 class data_chunk {};
@@ -63,6 +137,42 @@ void data_preparation_thread()
     }
 }
 
+// data arrives in bursts: prepare a batch, then push it with one lock
+#include <vector>
+
+void data_preparation_thread_batched()
+{
+    std::size_t const max_batch = 64;
+    std::vector<data_chunk> batch;
+    batch.reserve(max_batch);
+    while(more_data_to_prepare())
+    {
+        while(batch.size() < max_batch && more_data_to_prepare())
+        {
+            batch.push_back(prepare_data());
+        }
+        data_queue.push_range(batch.begin(), batch.end());
+        batch.clear();
+    }
+}
+
+void data_processing_thread_batched()
+{
+    std::vector<data_chunk> batch(64);
+    while(true)
+    {
+        std::size_t const n = data_queue.wait_and_pop_bulk(batch.begin(), batch.size());
+        for(std::size_t i = 0; i < n; ++i)
+        {
+            process(batch[i]);
+            if(is_last_chunk(batch[i]))
+            {
+                return;
+            }
+        }
+    }
+}
+
 void data_processing_thread()
 {
     while(true)
@@ -75,4 +185,386 @@ void data_processing_thread()
             break;
         }
     }
-}
\ No newline at end of file
+}
+
+/*
+lock-free bounded MPMC queue (ring buffer)
+
+thread_safe_queue_impl: every push and pop takes the same mutex and std::queue
+allocates when it grows.
+Here the buffer is allocated once, capacity must be a power of two.
+Each slot has a sequence number telling who can use it:
+- sequence == pos       -> empty, a producer at position pos can write it
+- sequence == pos + 1   -> full, a consumer at position pos can read it
+producers and consumers claim a position with a CAS on their own counter
+(enqueue_pos / dequeue_pos), each on its own cache line.
+Blocking calls spin on try_push/try_pop and go to the kernel (atomic wait)
+only when the queue is really full or empty; the other side notifies only
+if somebody is actually waiting.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+template<typename T>
+class bounded_mpmc_queue
+{
+private:
+    static constexpr std::size_t cache_line_size = 64;
+
+    struct slot
+    {
+        std::atomic<std::size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    std::size_t const mask;
+    std::unique_ptr<slot[]> buffer;
+    alignas(cache_line_size) std::atomic<std::size_t> enqueue_pos;
+    alignas(cache_line_size) std::atomic<std::size_t> dequeue_pos;
+    // event counters used only by the blocking calls
+    alignas(cache_line_size) std::atomic<unsigned> push_count;
+    std::atomic<unsigned> waiting_consumers;
+    alignas(cache_line_size) std::atomic<unsigned> pop_count;
+    std::atomic<unsigned> waiting_producers;
+
+    template<typename U>
+    bool do_try_push(U&& new_value)
+    {
+        slot* cell;
+        std::size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            cell = &buffer[pos & mask];
+            std::size_t const seq = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t const diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+            if(diff == 0)   // slot free, try to claim it
+            {
+                if(enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)   // slot still holds the value of the previous lap -> full
+            {
+                return false;
+            }
+            else    // another producer got it, reload
+            {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        new (cell->storage) T(std::forward<U>(new_value));
+        cell->sequence.store(pos + 1, std::memory_order_release);  // publish to consumers
+        notify_consumers();
+        return true;
+    }
+
+    // the fast path writes nothing shared: the counter is bumped only for a
+    // registered waiter. The fence orders the slot just published before the
+    // waiting_* read and pairs with the fence in push()/wait_and_pop():
+    // either we see the waiter, or the waiter's retry sees our slot
+    void notify_consumers()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiting_consumers.load(std::memory_order_relaxed))
+        {
+            push_count.fetch_add(1, std::memory_order_release);
+            push_count.notify_all();
+        }
+    }
+
+    void notify_producers()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(waiting_producers.load(std::memory_order_relaxed))
+        {
+            pop_count.fetch_add(1, std::memory_order_release);
+            pop_count.notify_all();
+        }
+    }
+
+public:
+    explicit bounded_mpmc_queue(std::size_t capacity) :
+        mask(capacity - 1),
+        buffer(new slot[capacity]),
+        enqueue_pos(0),
+        dequeue_pos(0),
+        push_count(0),
+        waiting_consumers(0),
+        pop_count(0),
+        waiting_producers(0)
+    {
+        if(capacity < 2 || (capacity & mask) != 0)
+        {
+            throw std::invalid_argument("capacity must be a power of two");
+        }
+        for(std::size_t i = 0; i < capacity; ++i)
+        {
+            buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bounded_mpmc_queue(const bounded_mpmc_queue&) = delete;
+    bounded_mpmc_queue& operator= (const bounded_mpmc_queue&) = delete;
+
+    ~bounded_mpmc_queue()
+    {
+        // no other thread can use the queue anymore, destroy the elements left
+        for(std::size_t pos = dequeue_pos.load(); pos != enqueue_pos.load(); ++pos)
+        {
+            std::launder(reinterpret_cast<T*>(buffer[pos & mask].storage))->~T();
+        }
+    }
+
+    // new_value is moved only if there is room for it
+    bool try_push(T const& new_value)
+    {
+        return do_try_push(new_value);
+    }
+
+    bool try_push(T&& new_value)
+    {
+        return do_try_push(std::move(new_value));
+    }
+
+    bool try_pop(T& value)
+    {
+        slot* cell;
+        std::size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+        for(;;)
+        {
+            cell = &buffer[pos & mask];
+            std::size_t const seq = cell->sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t const diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos + 1);
+            if(diff == 0)   // slot full, try to claim it
+            {
+                if(dequeue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if(diff < 0)   // nothing written here yet -> empty
+            {
+                return false;
+            }
+            else
+            {
+                pos = dequeue_pos.load(std::memory_order_relaxed);
+            }
+        }
+        T* const element = std::launder(reinterpret_cast<T*>(cell->storage));
+        value = std::move(*element);
+        element->~T();
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);  // free for the next lap
+        notify_producers();
+        return true;
+    }
+
+    void push(T new_value)
+    {
+        while(!try_push(std::move(new_value)))
+        {
+            waiting_producers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);   // pairs with notify_producers
+            unsigned const seen = pop_count.load(std::memory_order_acquire);
+            bool const pushed = try_push(std::move(new_value));    // a pop may have happened before we registered
+            if(!pushed)
+            {
+                pop_count.wait(seen, std::memory_order_acquire);   // sleeps only if no pop notified since seen
+            }
+            waiting_producers.fetch_sub(1, std::memory_order_relaxed);
+            if(pushed)
+            {
+                return;
+            }
+        }
+    }
+
+    void wait_and_pop(T& value)
+    {
+        while(!try_pop(value))
+        {
+            waiting_consumers.fetch_add(1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);   // pairs with notify_consumers
+            unsigned const seen = push_count.load(std::memory_order_acquire);
+            bool const popped = try_pop(value);
+            if(!popped)
+            {
+                push_count.wait(seen, std::memory_order_acquire);
+            }
+            waiting_consumers.fetch_sub(1, std::memory_order_relaxed);
+            if(popped)
+            {
+                return;
+            }
+        }
+    }
+};
+
+
+/*
+fine-grained unbounded queue: same interface as thread_safe_queue
+
+singly linked list with two mutexes, one for head (pop side) and one for
+tail (push side). The list always contains a dummy node at the end:
+- empty queue -> head and tail point to the dummy
+- push never touches head, pop touches tail only to compare it with head
+so a push and a pop can run at the same time.
+Data and the new node are allocated before taking the lock, the critical
+sections contain only pointer updates.
+Push and pop sides keep their own counters, on their own cache lines, so
+producers and consumers share nothing but the tail pointer. push takes
+head_mutex (to notify without losing a wakeup) only when a consumer sleeps.
+*/
+
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+
+template<typename T>
+class fine_grained_queue
+{
+private:
+    struct node
+    {
+        std::shared_ptr<T> data;
+        std::unique_ptr<node> next;
+    };
+
+    static constexpr std::size_t cache_line_size = 64;
+
+    // pop side
+    alignas(cache_line_size) mutable std::mutex head_mutex;
+    std::unique_ptr<node> head;
+    std::condition_variable data_cond;
+    std::atomic<unsigned> sleepers;         // consumers in wait_for_data
+    std::atomic<unsigned long> pop_count;   // written by consumers only
+    // push side
+    alignas(cache_line_size) mutable std::mutex tail_mutex;
+    node* tail;
+    std::atomic<unsigned long> push_count;  // written by producers only
+
+    node* get_tail() const
+    {
+        std::lock_guard<std::mutex> tail_lock(tail_mutex);
+        return tail;
+    }
+
+    // head_mutex must be held
+    std::unique_ptr<node> pop_head()
+    {
+        std::unique_ptr<node> old_head = std::move(head);
+        head = std::move(old_head->next);
+        pop_count.store(pop_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return old_head;
+    }
+
+    std::unique_lock<std::mutex> wait_for_data()
+    {
+        std::unique_lock<std::mutex> head_lock(head_mutex);
+        if(head.get() == get_tail())
+        {
+            // announce before the predicate is checked again in wait: a push either
+            // sees the sleeper and locks head_mutex to notify, or its node is seen here
+            ++sleepers;
+            data_cond.wait(head_lock, [&]{return head.get() != get_tail();});
+            --sleepers;
+        }
+        return head_lock;   // return the lock to the caller, still holding head_mutex
+    }
+
+    std::unique_ptr<node> try_pop_head()
+    {
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        if(head.get() == get_tail())
+        {
+            return std::unique_ptr<node>();
+        }
+        return pop_head();
+    }
+
+public:
+    fine_grained_queue() :
+        head(new node), sleepers(0), pop_count(0), tail(head.get()), push_count(0)
+    {}
+    fine_grained_queue(const fine_grained_queue&) = delete;
+    fine_grained_queue& operator= (const fine_grained_queue&) = delete;
+
+    void push(T new_value)
+    {
+        // allocations outside the lock
+        std::shared_ptr<T> new_data(std::make_shared<T>(std::move(new_value)));
+        std::unique_ptr<node> p(new node);
+        {
+            std::lock_guard<std::mutex> tail_lock(tail_mutex);
+            tail->data = new_data;  // old dummy gets the data, p is the new dummy
+            node* const new_tail = p.get();
+            tail->next = std::move(p);
+            tail = new_tail;
+            push_count.store(push_count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        if(sleepers.load() != 0)
+        {
+            // a consumer between its check and its wait holds head_mutex:
+            // taking it here makes the notify land after it is really waiting
+            std::lock_guard<std::mutex> head_lock(head_mutex);
+        }
+        data_cond.notify_one();
+    }
+
+    bool try_pop(T& value)
+    {
+        std::unique_ptr<node> const old_head = try_pop_head();
+        if(!old_head)
+        {
+            return false;
+        }
+        value = std::move(*old_head->data);
+        return true;
+    }
+
+    std::shared_ptr<T> try_pop()
+    {
+        std::unique_ptr<node> old_head = try_pop_head();
+        return old_head ? old_head->data : std::shared_ptr<T>();
+    }
+
+    void wait_and_pop(T& value)
+    {
+        std::unique_ptr<node> old_head;
+        {
+            std::unique_lock<std::mutex> head_lock(wait_for_data());
+            old_head = pop_head();
+        }
+        value = std::move(*old_head->data); // old node freed outside the lock
+    }
+
+    std::shared_ptr<T> wait_and_pop()
+    {
+        std::unique_ptr<node> old_head;
+        {
+            std::unique_lock<std::mutex> head_lock(wait_for_data());
+            old_head = pop_head();
+        }
+        return old_head->data;
+    }
+
+    bool empty() const
+    {
+        std::lock_guard<std::mutex> head_lock(head_mutex);
+        return head.get() == get_tail();
+    }
+
+    // only a snapshot, it can be out of date as soon as it is returned
+    unsigned long size() const
+    {
+        unsigned long const popped = pop_count.load(std::memory_order_relaxed);
+        unsigned long const pushed = push_count.load(std::memory_order_relaxed);
+        return pushed > popped ? pushed - popped : 0;
+    }
+};
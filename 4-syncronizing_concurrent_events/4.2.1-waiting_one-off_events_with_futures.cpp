@@ -80,4 +80,400 @@ auto f9 = std::async(
 ); // implementation choses
 
 auto f10 = std::async(Y(), 3.14); // implementation choses
-f8.wait() // invoke deferred func
\ No newline at end of file
+f8.wait() // invoke deferred func
+
+// ---------------------------------------------------------------------
+
+/*
+pooled promise / future
+every std::promise, std::packaged_task and std::async allocates its shared state on
+the heap and synchronizes it with a mutex + condition variable. With several
+futures per request both show up in profiles.
+pooled::promise<T> / pooled::future<T>:
+- the shared state comes from a per-thread free list of fixed size blocks
+  (pool_allocator), a block freed by another thread goes to that thread's list,
+  each list keeps at most max_cached blocks and gives the rest back to the heap
+- readiness is one atomic state word, waiting is atomic::wait (a futex on linux),
+  the producer only calls notify if a consumer is actually sleeping
+- any allocator can be passed with std::allocator_arg like std::promise
+- lifetime: promise and future hold one reference each, last one frees the state
+no timed waits (atomic::wait has no timeout): use std::future for those
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace pooled
+{
+
+template<std::size_t Size, std::size_t Align>
+class block_free_list
+{
+    struct node
+    {
+        node* next;
+    };
+
+    static constexpr std::size_t block_size = Size < sizeof(node) ? sizeof(node) : Size;
+    static constexpr std::size_t block_align = Align < alignof(node) ? alignof(node) : Align;
+    static constexpr std::size_t max_cached = 256;
+
+    node* head = nullptr;
+    std::size_t cached = 0;
+
+    block_free_list() = default;
+
+public:
+    ~block_free_list()
+    {
+        while(head)
+        {
+            node* const next = head->next;
+            ::operator delete(static_cast<void*>(head), std::align_val_t(block_align));
+            head = next;
+        }
+    }
+
+    static block_free_list& local()
+    {
+        thread_local block_free_list list;
+        return list;
+    }
+
+    void* allocate()
+    {
+        if(!head)
+        {
+            return ::operator new(block_size, std::align_val_t(block_align));
+        }
+        node* const res = head;
+        head = res->next;
+        --cached;
+        return res;
+    }
+
+    void deallocate(void* p)
+    {
+        if(cached == max_cached)
+        {
+            ::operator delete(p, std::align_val_t(block_align));
+            return;
+        }
+        head = ::new (p) node{head};
+        ++cached;
+    }
+};
+
+// stateless, single objects come from the thread's free list
+template<typename T>
+struct pool_allocator
+{
+    typedef T value_type;
+
+    pool_allocator() = default;
+    template<typename U>
+    pool_allocator(pool_allocator<U> const&) noexcept {}
+
+    T* allocate(std::size_t n)
+    {
+        if(n != 1)
+        {
+            return std::allocator<T>().allocate(n);
+        }
+        return static_cast<T*>(block_free_list<sizeof(T), alignof(T)>::local().allocate());
+    }
+
+    void deallocate(T* p, std::size_t n)
+    {
+        if(n != 1)
+        {
+            std::allocator<T>().deallocate(p, n);
+            return;
+        }
+        block_free_list<sizeof(T), alignof(T)>::local().deallocate(p);
+    }
+
+    template<typename U>
+    bool operator== (pool_allocator<U> const&) const noexcept { return true; }
+    template<typename U>
+    bool operator!= (pool_allocator<U> const&) const noexcept { return false; }
+};
+
+namespace detail
+{
+
+template<typename T>
+using stored_t = typename std::conditional<std::is_void<T>::value, std::nullptr_t, T>::type;
+
+template<typename T>
+class shared_state
+{
+    enum : unsigned { pending = 0, has_value = 1, has_exception = 2, retrieved = 4, waiting = 8 };
+
+    std::atomic<unsigned> status{pending};
+    std::atomic<unsigned> refs{1};
+    alignas(stored_t<T>) unsigned char storage[sizeof(stored_t<T>)];
+    std::exception_ptr error;
+    void (*const destroy)(shared_state*);
+
+    stored_t<T>& value() { return *std::launder(reinterpret_cast<stored_t<T>*>(storage)); }
+
+    void publish(unsigned result)
+    {
+        unsigned const old = status.fetch_or(result, std::memory_order_release);
+        if(old & (has_value | has_exception))
+        {
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        }
+        if(old & waiting)
+        {
+            status.notify_all();    // only pay for the syscall if somebody sleeps
+        }
+    }
+
+protected:
+    explicit shared_state(void (*destroy_)(shared_state*)) : destroy(destroy_) {}
+
+    ~shared_state()
+    {
+        if(status.load(std::memory_order_relaxed) & has_value)
+        {
+            value().~stored_t<T>();
+        }
+    }
+
+public:
+    void add_ref() { refs.fetch_add(1, std::memory_order_relaxed); }
+
+    void release()
+    {
+        if(refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            destroy(this);
+        }
+    }
+
+    void mark_retrieved()
+    {
+        if(status.fetch_or(retrieved, std::memory_order_relaxed) & retrieved)
+        {
+            throw std::future_error(std::future_errc::future_already_retrieved);
+        }
+    }
+
+    bool is_ready() const
+    {
+        return status.load(std::memory_order_acquire) & (has_value | has_exception);
+    }
+
+    template<typename... Args>
+    void set_value(Args&&... args)
+    {
+        if(is_ready())
+        {
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        }
+        ::new (storage) stored_t<T>(std::forward<Args>(args)...);  // single producer
+        publish(has_value);
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        if(is_ready())
+        {
+            throw std::future_error(std::future_errc::promise_already_satisfied);
+        }
+        error = e;
+        publish(has_exception);
+    }
+
+    void wait()
+    {
+        unsigned current = status.load(std::memory_order_acquire);
+        while(!(current & (has_value | has_exception)))
+        {
+            if(!(current & waiting))
+            {
+                status.fetch_or(waiting, std::memory_order_relaxed);
+                current |= waiting;
+            }
+            status.wait(current, std::memory_order_acquire);
+            current = status.load(std::memory_order_acquire);
+        }
+    }
+
+    stored_t<T>& get()
+    {
+        wait();
+        if(status.load(std::memory_order_acquire) & has_exception)
+        {
+            std::rethrow_exception(error);
+        }
+        return value();
+    }
+};
+
+template<typename T, typename Alloc>
+class allocated_state : public shared_state<T>
+{
+    typedef typename std::allocator_traits<Alloc>::template rebind_alloc<allocated_state> allocator_type;
+    typedef std::allocator_traits<allocator_type> traits;
+
+    allocator_type alloc;
+
+    static void destroy_self(shared_state<T>* base)
+    {
+        allocated_state* const self = static_cast<allocated_state*>(base);
+        allocator_type a(std::move(self->alloc));
+        self->~allocated_state();
+        traits::deallocate(a, self, 1);
+    }
+
+public:
+    explicit allocated_state(allocator_type const& a) :
+        shared_state<T>(&destroy_self), alloc(a)
+    {}
+
+    static shared_state<T>* create(Alloc const& a)
+    {
+        allocator_type alloc(a);
+        allocated_state* const p = traits::allocate(alloc, 1);
+        try
+        {
+            return ::new (static_cast<void*>(p)) allocated_state(alloc);
+        }
+        catch(...)
+        {
+            traits::deallocate(alloc, p, 1);
+            throw;
+        }
+    }
+};
+
+} // namespace detail
+
+template<typename T>
+class future
+{
+    template<typename>
+    friend class promise;
+
+    detail::shared_state<T>* state = nullptr;
+
+    explicit future(detail::shared_state<T>* state_) : state(state_) {}
+
+public:
+    future() = default;
+    future(future&& other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    future& operator= (future&& other) noexcept
+    {
+        std::swap(state, other.state);
+        return *this;
+    }
+    ~future()
+    {
+        if(state)
+        {
+            state->release();
+        }
+    }
+
+    bool valid() const { return state != nullptr; }
+    bool is_ready() const { return state->is_ready(); }
+    void wait() const { state->wait(); }
+
+    // one shot like std::future: the value is moved out and the future left empty
+    T get()
+    {
+        future tmp(std::move(*this));
+        if constexpr(std::is_void<T>::value)
+        {
+            tmp.state->get();
+        }
+        else
+        {
+            return std::move(tmp.state->get());
+        }
+    }
+};
+
+template<typename T>
+class promise
+{
+    detail::shared_state<T>* state;
+
+    detail::shared_state<T>& checked_state()
+    {
+        if(!state)
+        {
+            throw std::future_error(std::future_errc::no_state);
+        }
+        return *state;
+    }
+
+public:
+    promise() : state(detail::allocated_state<T, pool_allocator<char>>::create(pool_allocator<char>())) {}
+
+    template<typename Alloc>
+    promise(std::allocator_arg_t, Alloc const& alloc) :
+        state(detail::allocated_state<T, Alloc>::create(alloc))
+    {}
+
+    promise(promise&& other) noexcept : state(std::exchange(other.state, nullptr)) {}
+    promise& operator= (promise&& other) noexcept
+    {
+        promise(std::move(other)).swap(*this);
+        return *this;
+    }
+    ~promise()
+    {
+        if(!state)
+        {
+            return;
+        }
+        if(!state->is_ready())
+        {
+            state->set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+        }
+        state->release();
+    }
+
+    void swap(promise& other) noexcept { std::swap(state, other.state); }
+
+    future<T> get_future()
+    {
+        checked_state().mark_retrieved();
+        state->add_ref();
+        return future<T>(state);
+    }
+
+    template<typename... Args>
+    void set_value(Args&&... args)
+    {
+        checked_state().set_value(std::forward<Args>(args)...);
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        checked_state().set_exception(e);
+    }
+};
+
+} // namespace pooled
+
+/*
+drop-in for the request path:
+
+pooled::promise<int> p;
+pooled::future<int> f = p.get_future();
+std::thread t([&p]{ p.set_value(42); });
+std::cout << f.get() << std::endl;  // no heap allocation once the pool is warm, no mutex
+t.join();
+
+with an arena for a request: pooled::promise<int> p(std::allocator_arg, arena_allocator<int>(arena));
+*/
@@ -62,7 +62,7 @@ void gui_thread()
 std::thread gui_bg_thread(gui_thread);
 
 template<typename Func>
-std::future<void> post_task_for_gui_thread(Func f)
+std::future<void> post_packaged_task_for_gui_thread(Func f)
 {
     // wraps any function or callable that returns void an takes no param
     std::packaged_task<void()> task(f); // create a packaged task
@@ -76,4 +76,228 @@ std::future<void> post_task_for_gui_thread(Func f)
 what about tasks that cannot be expressed as a simple callable
 or what if the result comes from more than one place?
     --> std::promise 
-*/
\ No newline at end of file
+*/
+
+/*
+event driven gui task queue
+
+gui_thread above spins: when there are no tasks it goes round the loop again
+(continue), using a full core even when idle. And every posted callable is
+wrapped in a std::packaged_task, which allocates its shared state, even when
+nobody wants the future (and tasks.push_back(task) tries to copy it).
+- small_task: move-only void() callable, callables up to inline_size bytes are
+  stored inside the object (no allocation), bigger ones on the heap
+- post_task_for_gui_thread(f): just queues f, no future (it replaces
+  post_packaged_task_for_gui_thread of the polling version)
+- post_task_for_gui_thread_with_result(f): packaged_task only when the caller
+  wants the result
+- the gui thread blocks until either a gui message or a task arrives: posting a
+  task wakes it up through the same primitive the message pump waits on.
+  Here a condition variable with a count of pending gui messages (one
+  get_and_process_gui_message() per notification, none is lost); with a real
+  toolkit it would be e.g. PostMessage / an eventfd in the poll set of the pump.
+*/
+
+#include <condition_variable>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+class small_task
+{
+private:
+    static std::size_t const inline_size = 48;
+
+    struct ops
+    {
+        void (*call)(void*);
+        void (*move)(void* from, void* to);   // move constructs into to, destroys from
+        void (*destroy)(void*);
+    };
+
+    template<typename F, bool Inline>
+    struct ops_for
+    {
+        static F* get(void* storage)
+        {
+            if constexpr (Inline)
+            {
+                return std::launder(reinterpret_cast<F*>(storage));
+            }
+            else
+            {
+                return *reinterpret_cast<F**>(storage);
+            }
+        }
+        static void call(void* storage) { (*get(storage))(); }
+        static void move(void* from, void* to)
+        {
+            if constexpr (Inline)
+            {
+                new (to) F(std::move(*get(from)));
+                get(from)->~F();
+            }
+            else
+            {
+                *reinterpret_cast<F**>(to) = get(from);   // heap object: just move the pointer
+            }
+        }
+        static void destroy(void* storage)
+        {
+            if constexpr (Inline)
+            {
+                get(storage)->~F();
+            }
+            else
+            {
+                delete get(storage);
+            }
+        }
+        static constexpr ops table = {&call, &move, &destroy};
+    };
+
+    alignas(std::max_align_t) unsigned char storage[inline_size];
+    ops const* vtable;
+
+public:
+    small_task() noexcept : vtable(nullptr) {}
+
+    template<typename F, typename Callable = std::decay_t<F>,
+        typename = std::enable_if_t<!std::is_same<Callable, small_task>::value> >
+    small_task(F&& f)
+    {
+        constexpr bool fits = sizeof(Callable) <= inline_size
+            && alignof(Callable) <= alignof(std::max_align_t)
+            && std::is_nothrow_move_constructible<Callable>::value;
+        if constexpr (fits)
+        {
+            new (storage) Callable(std::forward<F>(f));
+        }
+        else
+        {
+            *reinterpret_cast<Callable**>(storage) = new Callable(std::forward<F>(f));
+        }
+        vtable = &ops_for<Callable, fits>::table;
+    }
+
+    small_task(small_task&& other) noexcept : vtable(other.vtable)
+    {
+        if(vtable)
+        {
+            vtable->move(other.storage, storage);
+            other.vtable = nullptr;
+        }
+    }
+
+    small_task& operator= (small_task&& other) noexcept
+    {
+        if(this != &other)
+        {
+            reset();
+            vtable = other.vtable;
+            if(vtable)
+            {
+                vtable->move(other.storage, storage);
+                other.vtable = nullptr;
+            }
+        }
+        return *this;
+    }
+
+    small_task(small_task const&) = delete;
+    small_task& operator= (small_task const&) = delete;
+
+    ~small_task() { reset(); }
+
+    void reset() noexcept
+    {
+        if(vtable)
+        {
+            vtable->destroy(storage);
+            vtable = nullptr;
+        }
+    }
+
+    explicit operator bool() const noexcept { return vtable != nullptr; }
+
+    void operator() () { vtable->call(storage); }
+};
+
+class gui_task_queue
+{
+private:
+    std::mutex m;
+    std::condition_variable wakeup;
+    std::deque<small_task> tasks;
+    std::size_t gui_messages_pending = 0;
+
+public:
+    void post(small_task task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push_back(std::move(task));
+        }
+        wakeup.notify_one();
+    }
+
+    // called by the windowing system side when a gui message arrives
+    void notify_gui_message()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            ++gui_messages_pending;
+        }
+        wakeup.notify_one();
+    }
+
+    // blocks until there is something to do, no polling.
+    // returns the number of gui messages notified since the last call,
+    // moves the queued tasks into ready
+    std::size_t wait(std::deque<small_task>& ready)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        wakeup.wait(lock, [this]{return gui_messages_pending != 0 || !tasks.empty();});
+        ready.swap(tasks);      // take all the tasks with one lock
+        std::size_t const messages = gui_messages_pending;
+        gui_messages_pending = 0;
+        return messages;
+    }
+};
+
+gui_task_queue gui_tasks;
+
+void event_driven_gui_thread()
+{
+    std::deque<small_task> ready;
+    while(!shutdown_gui_message_received())
+    {
+        // sleeps here when idle: zero cpu
+        for(std::size_t messages = gui_tasks.wait(ready); messages > 0; --messages)
+        {
+            get_and_process_gui_message();
+        }
+        while(!ready.empty())   // run outside the lock
+        {
+            small_task task = std::move(ready.front());
+            ready.pop_front();
+            task();
+        }
+    }
+}
+
+template<typename Func>
+void post_task_for_gui_thread(Func&& f)
+{
+    gui_tasks.post(small_task(std::forward<Func>(f)));  // no packaged_task, no future
+}
+
+template<typename Func>
+std::future<std::invoke_result_t<std::decay_t<Func>&> > post_task_for_gui_thread_with_result(Func&& f)
+{
+    typedef std::invoke_result_t<std::decay_t<Func>&> result_type;
+    std::packaged_task<result_type()> task(std::forward<Func>(f));
+    std::future<result_type> res = task.get_future();
+    gui_tasks.post(small_task(std::move(task)));     // moved, not copied
+    return res;
+}
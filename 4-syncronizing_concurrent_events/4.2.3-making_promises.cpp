@@ -62,4 +62,807 @@ void process_connections (connection_set& connections)
 }
 
 // use std::promise.set_exception() to set the exception to the future, can be later retrieved with try/catch
-// std::promise.set_exception(std::current_exception()) to set automatically the exception
\ No newline at end of file
+// std::promise.set_exception(std::current_exception()) to set automatically the exception
+
+/*
+event loop version with epoll (Linux)
+
+process_connections checks every connection on every pass, even when none of
+them has data: one core always busy and O(connections) work per pass.
+With epoll the kernel tells which sockets are ready, and epoll_wait sleeps
+while nothing happens.
+- io_loop: one thread, one epoll instance, it owns a subset of the connections
+- connection_multiplexer: a small fixed number of io_loops, connections are
+  assigned round robin, each connection is handled by one thread only
+- incoming packets fulfil the promise registered for their id, as before
+- outgoing packets are queued by any thread; the io thread is woken through an
+  eventfd and asks for EPOLLOUT only while the connection has something to send
+wire format of the stand-in protocol: int id, uint32 count, count ints of payload
+*/
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <system_error>
+#include <thread>
+#include <atomic>
+
+typedef std::vector<int> payload_type;
+
+/*
+lock-free packet id -> promise table
+
+with several io threads fulfilling and many requesting threads registering ids,
+the id -> promise map of a connection is on the critical path of every packet.
+promise_table: open addressing (linear probing) on a fixed array of slots, each
+slot has an atomic tag = packet id + generation + state:
+- empty: never used
+- busy: claimed by one thread that is constructing / completing the promise
+- registered: promise waiting for its packet
+- free: completed, can be reused by a new id
+register / fulfil / fail / erase claim a slot with a CAS on the tag, so no locks
+and only the thread that won the CAS touches the promise. Completed slots are
+recycled by the next registrations.
+- a registration goes at most max_probe_limit slots past the home slot (table
+  full otherwise), and lookups stop after the longest probe sequence one needed:
+  an unknown id costs a few probes even when no slot is empty any more
+- each registration bumps the slot's generation: register_id hands out a ticket
+  (slot + full tag) and expire(ticket) only fails that very request, not a later
+  one that reused the id and the slot
+deadlines are not kept here: the io loop keeps them in a heap (see io_loop).
+capacity: power of two, about twice the requests in flight keeps probes short.
+*/
+
+#include <chrono>
+#include <new>
+#include <stdexcept>
+
+struct request_timeout : std::runtime_error
+{
+    request_timeout() : std::runtime_error("request timed out") {}
+};
+
+struct connection_closed : std::runtime_error
+{
+    connection_closed() : std::runtime_error("connection closed") {}
+};
+
+template<typename T>
+class promise_table
+{
+public:
+    struct ticket
+    {
+        std::size_t slot = 0;
+        std::uint64_t tag = 0;
+    };
+
+private:
+    // tag: id (32 bits) | generation (30 bits) | state (2 bits)
+    enum : std::uint64_t { empty = 0, busy = 1, registered = 2, free = 3 };
+    static constexpr std::uint64_t generation_mask = (std::uint64_t(1) << 30) - 1;
+
+    static std::uint64_t make_tag(std::int32_t id, std::uint64_t generation, std::uint64_t state)
+    {
+        return (std::uint64_t(std::uint32_t(id)) << 32) | ((generation & generation_mask) << 2) | state;
+    }
+    static std::uint64_t with_state(std::uint64_t tag, std::uint64_t state) { return (tag & ~std::uint64_t(3)) | state; }
+    static std::uint64_t state_of(std::uint64_t tag) { return tag & 3; }
+    static std::uint64_t generation_of(std::uint64_t tag) { return (tag >> 2) & generation_mask; }
+    static std::int32_t id_of(std::uint64_t tag) { return std::int32_t(std::uint32_t(tag >> 32)); }
+
+    struct slot
+    {
+        std::atomic<std::uint64_t> tag{empty};
+        alignas(std::promise<T>) unsigned char storage[sizeof(std::promise<T>)];
+
+        std::promise<T>& promise() { return *std::launder(reinterpret_cast<std::promise<T>*>(storage)); }
+    };
+
+    std::size_t const mask;
+    std::unique_ptr<slot[]> slots;
+    static constexpr std::size_t max_probe_limit = 64;   // far beyond any cluster at load factor 0.5
+    std::atomic<std::size_t> max_probe{0};  // longest distance from home of a registration, <= max_probe_limit
+
+    std::size_t home(std::int32_t id) const
+    {
+        return (std::uint32_t(id) * 2654435761u) & mask;   // Knuth multiplicative hash
+    }
+
+    // claims the registered slot of id (registered -> busy), null if not there
+    slot* claim(std::int32_t id, std::uint64_t& claimed)
+    {
+        std::size_t const probes = max_probe.load(std::memory_order_acquire);
+        for(std::size_t i = 0, index = home(id); i <= probes; ++i, index = (index + 1) & mask)
+        {
+            std::uint64_t tag = slots[index].tag.load(std::memory_order_acquire);
+            if(state_of(tag) == empty)
+            {
+                return nullptr;
+            }
+            if(state_of(tag) == registered && id_of(tag) == id
+                && slots[index].tag.compare_exchange_strong(tag, with_state(tag, busy), std::memory_order_acquire))
+            {
+                claimed = tag;
+                return &slots[index];
+            }
+        }
+        return nullptr;
+    }
+
+    void release(slot& s, std::uint64_t tag)
+    {
+        s.promise().~promise();
+        s.tag.store(with_state(tag, free), std::memory_order_release);   // recycled by the next register
+    }
+
+public:
+    explicit promise_table(std::size_t capacity = 1024) :
+        mask(capacity - 1), slots(new slot[capacity])
+    {
+        if(capacity < 2 || (capacity & mask) != 0)
+        {
+            throw std::invalid_argument("capacity must be a power of two");
+        }
+    }
+
+    ~promise_table()
+    {
+        for(std::size_t i = 0; i <= mask; ++i)
+        {
+            if(state_of(slots[i].tag.load()) == registered)
+            {
+                slots[i].promise().~promise();  // futures get broken_promise
+            }
+        }
+    }
+
+    promise_table(promise_table const&) = delete;
+    promise_table& operator= (promise_table const&) = delete;
+
+    // the id must not be in flight already
+    std::future<T> register_id(std::int32_t id, ticket& t)
+    {
+        std::size_t const limit = mask < max_probe_limit ? mask : max_probe_limit;
+        for(std::size_t i = 0, index = home(id); i <= limit; ++i, index = (index + 1) & mask)
+        {
+            slot& s = slots[index];
+            std::uint64_t tag = s.tag.load(std::memory_order_relaxed);
+            if(state_of(tag) != empty && state_of(tag) != free)
+            {
+                continue;
+            }
+            std::uint64_t const generation = generation_of(tag) + 1;
+            if(s.tag.compare_exchange_strong(tag, make_tag(id, generation, busy), std::memory_order_acquire))
+            {
+                std::size_t probes = max_probe.load(std::memory_order_relaxed);
+                while(probes < i && !max_probe.compare_exchange_weak(probes, i, std::memory_order_release));
+                new (s.storage) std::promise<T>();
+                std::future<T> res = s.promise().get_future();
+                t.slot = index;
+                t.tag = make_tag(id, generation, registered);
+                s.tag.store(t.tag, std::memory_order_release);  // visible to fulfil
+                return res;
+            }
+        }
+        throw std::runtime_error("promise_table full");
+    }
+
+    std::future<T> register_id(std::int32_t id)
+    {
+        ticket t;
+        return register_id(id, t);
+    }
+
+    // true while the request of the ticket waits for its packet
+    bool waiting(ticket const& t) const
+    {
+        return slots[t.slot].tag.load(std::memory_order_relaxed) == t.tag;
+    }
+
+    // false if nobody is waiting for id (unknown, expired or already answered)
+    bool fulfil(std::int32_t id, T value)
+    {
+        std::uint64_t tag;
+        slot* const s = claim(id, tag);
+        if(!s)
+        {
+            return false;
+        }
+        s->promise().set_value(std::move(value));
+        release(*s, tag);
+        return true;
+    }
+
+    // false if nobody is waiting for id
+    bool fail(std::int32_t id, std::exception_ptr e)
+    {
+        std::uint64_t tag;
+        slot* const s = claim(id, tag);
+        if(!s)
+        {
+            return false;
+        }
+        s->promise().set_exception(e);
+        release(*s, tag);
+        return true;
+    }
+
+    // fails every registered request, returns how many
+    std::size_t fail_all(std::exception_ptr e)
+    {
+        std::size_t failed = 0;
+        for(std::size_t i = 0; i <= mask; ++i)
+        {
+            slot& s = slots[i];
+            std::uint64_t tag = s.tag.load(std::memory_order_acquire);
+            if(state_of(tag) == registered && s.tag.compare_exchange_strong(tag, with_state(tag, busy), std::memory_order_acquire))
+            {
+                s.promise().set_exception(e);
+                release(s, tag);
+                ++failed;
+            }
+        }
+        return failed;
+    }
+
+    bool erase(std::int32_t id)
+    {
+        std::uint64_t tag;
+        slot* const s = claim(id, tag);
+        if(!s)
+        {
+            return false;
+        }
+        release(*s, tag);    // the future gets broken_promise
+        return true;
+    }
+
+    // fails the request of the ticket with request_timeout if it is still waiting.
+    // the generation in the tag makes it a no-op once the slot has been reused
+    bool expire(ticket const& t)
+    {
+        slot& s = slots[t.slot];
+        std::uint64_t tag = t.tag;
+        if(!s.tag.compare_exchange_strong(tag, with_state(tag, busy), std::memory_order_acquire))    // answered, or lost against fulfil
+        {
+            return false;
+        }
+        s.promise().set_exception(std::make_exception_ptr(request_timeout()));
+        release(s, t.tag);
+        return true;
+    }
+};
+
+class io_loop;
+
+class socket_connection : public std::enable_shared_from_this<socket_connection>
+{
+private:
+    friend class io_loop;
+
+    struct packet_header
+    {
+        std::int32_t id;
+        std::uint32_t count;
+    };
+
+    struct outgoing_packet
+    {
+        std::vector<char> bytes;
+        std::promise<bool> promise;
+    };
+
+    int const fd;
+    io_loop* loop = nullptr;
+    std::atomic<bool> closed{false};   // set by the io thread when the socket is gone
+
+    promise_table<payload_type> requests;
+
+    std::mutex outgoing_mutex;
+    std::deque<outgoing_packet> outgoing;
+
+    // used only by the io thread
+    std::vector<char> in_buffer;
+    std::size_t out_offset = 0;
+    bool writing = false;   // EPOLLOUT requested
+
+    static std::uint32_t const max_payload_count = 1 << 20;
+
+    void packet_received(int id, payload_type payload);
+    bool parse_packets();
+    bool read_ready();
+    bool write_ready();
+    void shutdown();
+    void add_deadline(std::chrono::steady_clock::time_point when, promise_table<payload_type>::ticket const& ticket);
+
+public:
+    // takes ownership of fd
+    explicit socket_connection(int fd_, std::size_t max_requests_in_flight = 512) :
+        fd(fd_), requests(std::size_t(1) << (64 - __builtin_clzll(2 * max_requests_in_flight - 1)))
+    {
+        int const flags = fcntl(fd, F_GETFL);
+        if(flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        {
+            int const error = errno;
+            close(fd);
+            throw std::system_error(error, std::generic_category(), "socket_connection");
+        }
+    }
+
+    ~socket_connection()
+    {
+        close(fd);
+    }
+
+    socket_connection(socket_connection const&) = delete;
+    socket_connection& operator= (socket_connection const&) = delete;
+
+    // future for the packet with this id: register it before sending the request,
+    // packets nobody is waiting for are dropped.
+    // if no packet arrives within timeout the future gets request_timeout
+    // on a closed connection (or when it gets closed) the future gets connection_closed
+    std::future<payload_type> expect(int id, std::chrono::milliseconds timeout = std::chrono::seconds(30))
+    {
+        if(closed.load())
+        {
+            std::promise<payload_type> p;
+            p.set_exception(std::make_exception_ptr(connection_closed()));
+            return p.get_future();
+        }
+        promise_table<payload_type>::ticket ticket;
+        std::future<payload_type> res = requests.register_id(id, ticket);
+        if(closed.load())
+        {
+            requests.fail(id, std::make_exception_ptr(connection_closed()));    // raced with shutdown()
+            return res;
+        }
+        add_deadline(std::chrono::steady_clock::now() + timeout, ticket);
+        return res;
+    }
+
+    bool request_waiting(promise_table<payload_type>::ticket const& ticket) const
+    {
+        return requests.waiting(ticket);
+    }
+
+    void expire_request(promise_table<payload_type>::ticket const& ticket)
+    {
+        requests.expire(ticket);
+    }
+
+    // the future becomes true when the packet has been written to the socket,
+    // false if it could not be (error, connection closed)
+    std::future<bool> send(int id, payload_type const& payload);
+};
+
+class io_loop
+{
+public:
+    struct request_deadline
+    {
+        std::chrono::steady_clock::time_point when;
+        std::weak_ptr<socket_connection> connection;    // requests of removed connections expire too
+        promise_table<payload_type>::ticket ticket;
+
+        bool operator> (request_deadline const& other) const { return when > other.when; }
+    };
+
+private:
+    int const epoll_fd;
+    int const wake_fd;
+    std::atomic<bool> done;
+    std::mutex pending_mutex;
+    std::vector<std::shared_ptr<socket_connection> > to_add;
+    std::vector<socket_connection*> to_write;
+    std::vector<request_deadline> new_deadlines;
+    // io thread only: min-heap, earliest deadline in front. Entries of answered requests
+    // are dropped when their time comes or, before that, by compact_deadlines()
+    std::vector<request_deadline> deadlines;
+    std::size_t compact_at = min_compact_size;
+    std::map<socket_connection*, std::shared_ptr<socket_connection> > connections;
+    std::thread thread;
+
+    // false if the socket can't be watched any more
+    bool update_events(socket_connection* c, bool want_write)
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        if(want_write)
+        {
+            ev.events |= EPOLLOUT;
+        }
+        ev.data.ptr = c;
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev) < 0)
+        {
+            return false;
+        }
+        c->writing = want_write;
+        return true;
+    }
+
+    void remove(socket_connection* c)
+    {
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, nullptr);  // can only fail if it isn't registered
+        c->shutdown();          // the caller may keep the connection alive: fail what is pending now
+        connections.erase(c);
+    }
+
+    // requests from other threads, applied by the io thread
+    void handle_wakeup()
+    {
+        std::uint64_t counter;
+        while(read(wake_fd, &counter, sizeof(counter)) > 0);
+        std::vector<std::shared_ptr<socket_connection> > added;
+        std::vector<socket_connection*> writes;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            added.swap(to_add);
+            writes.swap(to_write);
+        }
+        for(auto& c : added)
+        {
+            epoll_event ev{};
+            ev.events = EPOLLIN;
+            ev.data.ptr = c.get();
+            if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+            {
+                c->shutdown();  // never served: fail its requests instead of leaving them pending
+                continue;
+            }
+            connections.emplace(c.get(), c);
+        }
+        for(auto* c : writes)
+        {
+            if(connections.count(c) && !c->writing && !update_events(c, true))
+            {
+                remove(c);
+            }
+        }
+    }
+
+    static constexpr int expire_interval_ms = 100;
+    static constexpr std::size_t min_compact_size = 1024;
+
+    // most requests are answered long before their timeout: without this the heap
+    // would hold request rate x timeout entries. Keeps only the waiting ones, and
+    // runs again when the heap has doubled: O(1) amortized per request
+    void compact_deadlines()
+    {
+        auto const answered = std::remove_if(deadlines.begin(), deadlines.end(), [](request_deadline const& d){
+            auto const c = d.connection.lock();
+            return !c || !c->request_waiting(d.ticket);
+        });
+        deadlines.erase(answered, deadlines.end());
+        std::make_heap(deadlines.begin(), deadlines.end(), std::greater<request_deadline>());
+        compact_at = std::max(min_compact_size, 2 * deadlines.size());
+    }
+
+    // O(log n) per request instead of scanning every slot of every connection
+    void expire_requests(std::chrono::steady_clock::time_point now)
+    {
+        std::vector<request_deadline> added;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            added.swap(new_deadlines);
+        }
+        for(auto& d : added)
+        {
+            deadlines.push_back(std::move(d));
+            std::push_heap(deadlines.begin(), deadlines.end(), std::greater<request_deadline>());
+        }
+        if(deadlines.size() >= compact_at)
+        {
+            compact_deadlines();
+        }
+        while(!deadlines.empty() && deadlines.front().when <= now)
+        {
+            if(auto c = deadlines.front().connection.lock())
+            {
+                c->expire_request(deadlines.front().ticket);  // no-op if already answered
+            }
+            std::pop_heap(deadlines.begin(), deadlines.end(), std::greater<request_deadline>());
+            deadlines.pop_back();
+        }
+    }
+
+    void run()
+    {
+        epoll_event events[64];
+        auto last_expire = std::chrono::steady_clock::now();
+        while(!done)
+        {
+            // sleeps until something is ready, wakes at least every expire_interval for timeouts
+            int const n = epoll_wait(epoll_fd, events, 64, expire_interval_ms);
+            for(int i = 0; i < n; ++i)
+            {
+                if(!events[i].data.ptr)
+                {
+                    handle_wakeup();
+                    continue;
+                }
+                auto* const c = static_cast<socket_connection*>(events[i].data.ptr);
+                if(!connections.count(c))
+                {
+                    continue;   // removed earlier in this batch
+                }
+                bool alive = true;
+                if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                {
+                    alive = c->read_ready();
+                }
+                if(alive && (events[i].events & EPOLLOUT))
+                {
+                    bool const more = c->write_ready();
+                    if(!more)
+                    {
+                        alive = update_events(c, false);    // stop EPOLLOUT, or epoll_wait never sleeps
+                    }
+                }
+                if(!alive)
+                {
+                    remove(c);
+                }
+            }
+            auto const now = std::chrono::steady_clock::now();
+            if(now - last_expire >= std::chrono::milliseconds(expire_interval_ms))
+            {
+                expire_requests(now);
+                last_expire = now;
+            }
+        }
+        for(auto& c : connections)
+        {
+            c.second->shutdown();
+        }
+    }
+
+    void wake()
+    {
+        std::uint64_t const one = 1;
+        (void)!write(wake_fd, &one, sizeof(one));
+    }
+
+public:
+    io_loop() :
+        epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+        wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        done(false)
+    {
+        if(epoll_fd < 0 || wake_fd < 0)
+        {
+            int const error = errno;
+            if(epoll_fd >= 0)
+            {
+                close(epoll_fd);
+            }
+            if(wake_fd >= 0)
+            {
+                close(wake_fd);
+            }
+            throw std::system_error(error, std::generic_category(), "io_loop");
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;  // null -> wakeup
+        if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+        {
+            int const error = errno;
+            close(wake_fd);
+            close(epoll_fd);
+            throw std::system_error(error, std::generic_category(), "io_loop");
+        }
+        thread = std::thread(&io_loop::run, this);
+    }
+
+    ~io_loop()
+    {
+        done = true;
+        wake();
+        thread.join();
+        close(wake_fd);
+        close(epoll_fd);
+    }
+
+    void add(std::shared_ptr<socket_connection> c)
+    {
+        c->loop = this;
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            to_add.push_back(std::move(c));
+        }
+        wake();
+    }
+
+    // no wakeup: picked up by the next sweep, at most expire_interval late
+    void add_deadline(request_deadline d)
+    {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        new_deadlines.push_back(std::move(d));
+    }
+
+    void request_write(socket_connection* c)
+    {
+        {
+            std::lock_guard<std::mutex> lock(pending_mutex);
+            to_write.push_back(c);
+        }
+        wake();
+    }
+};
+
+void socket_connection::shutdown()
+{
+    closed = true;
+    std::deque<outgoing_packet> unsent;
+    {
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        unsent.swap(outgoing);
+        out_offset = 0;
+    }
+    for(auto& packet : unsent)
+    {
+        packet.promise.set_value(false);
+    }
+    requests.fail_all(std::make_exception_ptr(connection_closed()));
+}
+
+void socket_connection::add_deadline(std::chrono::steady_clock::time_point when, promise_table<payload_type>::ticket const& ticket)
+{
+    loop->add_deadline(io_loop::request_deadline{when, weak_from_this(), ticket});
+}
+
+void socket_connection::packet_received(int id, payload_type payload)
+{
+    requests.fulfil(id, std::move(payload));  // promise associated to the id, no lock
+}
+
+// delivers the complete packets in in_buffer, false on a malformed packet
+bool socket_connection::parse_packets()
+{
+    std::size_t offset = 0;
+    while(in_buffer.size() - offset >= sizeof(packet_header))
+    {
+        packet_header header;
+        std::memcpy(&header, in_buffer.data() + offset, sizeof(header));
+        if(header.count > max_payload_count)
+        {
+            return false;   // the size comes from the network: don't buffer without limit
+        }
+        std::size_t const size = sizeof(header) + header.count * sizeof(int);
+        if(in_buffer.size() - offset < size)
+        {
+            break;
+        }
+        payload_type payload(header.count);
+        std::memcpy(payload.data(), in_buffer.data() + offset + sizeof(header), header.count * sizeof(int));
+        packet_received(header.id, std::move(payload));
+        offset += size;
+    }
+    in_buffer.erase(in_buffer.begin(), in_buffer.begin() + offset);
+    return true;
+}
+
+bool socket_connection::read_ready()
+{
+    char buffer[4096];
+    for(;;)
+    {
+        ssize_t const n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n > 0)
+        {
+            in_buffer.insert(in_buffer.end(), buffer, buffer + n);
+            if(!parse_packets())    // as data comes: at most one partial packet stays buffered
+            {
+                return false;
+            }
+            continue;
+        }
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;    // drained
+        }
+        if(n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        return false;   // closed by the peer or error, the packets before it were delivered
+    }
+}
+
+bool socket_connection::write_ready()
+{
+    for(;;)
+    {
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        if(outgoing.empty())
+        {
+            return false;
+        }
+        outgoing_packet& packet = outgoing.front();
+        while(out_offset < packet.bytes.size())
+        {
+            ssize_t const n = ::send(fd, packet.bytes.data() + out_offset, packet.bytes.size() - out_offset, MSG_NOSIGNAL);
+            if(n < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                if(errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return true;    // socket buffer full, wait for the next EPOLLOUT
+                }
+                packet.promise.set_value(false);
+                outgoing.pop_front();
+                out_offset = 0;
+                return !outgoing.empty();
+            }
+            out_offset += n;
+        }
+        packet.promise.set_value(true); // when data is sent promise associated is set to true
+        outgoing.pop_front();
+        out_offset = 0;
+    }
+}
+
+std::future<bool> socket_connection::send(int id, payload_type const& payload)
+{
+    outgoing_packet packet;
+    packet_header const header{id, static_cast<std::uint32_t>(payload.size())};
+    packet.bytes.resize(sizeof(header) + payload.size() * sizeof(int));
+    std::memcpy(packet.bytes.data(), &header, sizeof(header));
+    std::memcpy(packet.bytes.data() + sizeof(header), payload.data(), payload.size() * sizeof(int));
+    std::future<bool> res = packet.promise.get_future();
+    {
+        std::lock_guard<std::mutex> lock(outgoing_mutex);
+        if(closed)
+        {
+            packet.promise.set_value(false);    // nobody would ever write it
+            return res;
+        }
+        outgoing.push_back(std::move(packet));
+    }
+    loop->request_write(this);
+    return res;
+}
+
+class connection_multiplexer
+{
+private:
+    std::vector<std::unique_ptr<io_loop> > loops;
+    std::atomic<unsigned> next_loop;
+
+public:
+    explicit connection_multiplexer(unsigned num_io_threads = 2) : next_loop(0)
+    {
+        for(unsigned i = 0; i < num_io_threads; ++i)
+        {
+            loops.push_back(std::make_unique<io_loop>());
+        }
+    }
+
+    std::shared_ptr<socket_connection> add(int fd)
+    {
+        auto c = std::make_shared<socket_connection>(fd);
+        loops[next_loop++ % loops.size()]->add(c);
+        return c;
+    }
+};
+
+// connection_multiplexer mux(2);          // two io threads for all the connections
+// auto conn = mux.add(connected_socket_fd);
+// std::future<payload_type> reply = conn->expect(42, std::chrono::seconds(5));
+// conn->send(42, request_payload);
+// payload_type data = reply.get();
@@ -35,4 +35,168 @@ std::shared_future<std::string> sf(p2.get_future());
 
 // can use share and automatic type deduction
 std::promise< std::map< SomeIndexType, SomeDataType, SomeComparator, SomeAllocator>::iterator> p;
-auto sf=p.get_future().share();
\ No newline at end of file
+auto sf=p.get_future().share();
+
+// ---------------------------------------------------------------------
+
+/*
+one-shot broadcast
+a copy of std::shared_future per thread still means a refcount increment per copy
+and a trip through the shared state mutex on every get(): with thousands of
+waiters (configuration reload fanned out to every worker) the state's cache line
+bounces between all of them.
+broadcast_value<T>: one-shot cell, set once, read by any number of threads
+- after publication readers only load: state word + value, no refcount, no lock,
+  the cache line stays shared in every core
+- a reader that finds it empty sets a "waiting" flag once and sleeps on the state
+  word with atomic::wait, the writer wakes all of them with one notify_all
+  (one futex wake on linux) and only if the flag is set
+- the cell is not copied around, threads get a reference/pointer to it, its
+  lifetime is the owner's business (see config_generation below)
+*/
+
+#include <atomic>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+template<typename T>
+class broadcast_value
+{
+    enum : unsigned { empty = 0, writing = 1, ready = 2, waiting = 4 };
+
+    // own cache line: no false sharing with whatever lives next to the cell
+    alignas(64) mutable std::atomic<unsigned> state{empty};   // readers may set the waiting flag
+    alignas(T) unsigned char storage[sizeof(T)];
+
+    T const& value() const { return *std::launder(reinterpret_cast<T const*>(storage)); }
+
+public:
+    broadcast_value() = default;
+    broadcast_value(broadcast_value const&) = delete;
+    broadcast_value& operator= (broadcast_value const&) = delete;
+
+    ~broadcast_value()
+    {
+        if(state.load(std::memory_order_relaxed) & ready)
+        {
+            value().~T();
+        }
+    }
+
+    template<typename... Args>
+    void publish(Args&&... args)
+    {
+        unsigned current = state.load(std::memory_order_relaxed);
+        do
+        {
+            if(current & (writing | ready))
+            {
+                throw std::logic_error("broadcast_value already published");
+            }
+        } while(!state.compare_exchange_weak(current, current | writing, std::memory_order_relaxed));
+        try
+        {
+            ::new (storage) T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            state.fetch_and(~unsigned(writing), std::memory_order_relaxed);
+            throw;
+        }
+        if(state.exchange(ready, std::memory_order_release) & waiting)
+        {
+            state.notify_all(); // single wake for every parked reader
+        }
+    }
+
+    bool is_ready() const
+    {
+        return state.load(std::memory_order_acquire) & ready;
+    }
+
+    // null until published
+    T const* try_get() const
+    {
+        return is_ready() ? &value() : nullptr;
+    }
+
+    T const& get() const
+    {
+        unsigned current = state.load(std::memory_order_acquire);
+        while(!(current & ready))
+        {
+            if(!(current & waiting))
+            {
+                // only write a reader ever does, and only before publication
+                current = state.fetch_or(waiting, std::memory_order_acquire) | waiting;
+                continue;
+            }
+            state.wait(current, std::memory_order_acquire);
+            current = state.load(std::memory_order_acquire);
+        }
+        return value();
+    }
+};
+
+/*
+configuration reload: every generation carries the cell of the next one.
+a worker reads its current generation with plain loads, checks try_get() on the
+next cell between jobs and moves to it when it is published: one refcount bump per
+worker per reload, nothing per read.
+*/
+
+#include <map>
+#include <string>
+
+struct config_generation
+{
+    std::map<std::string, std::string> settings;
+    broadcast_value<std::shared_ptr<config_generation const>> next;   // the one-shot part
+
+    explicit config_generation(std::map<std::string, std::string> settings_) :
+        settings(std::move(settings_))
+    {}
+};
+
+class config_source
+{
+    std::shared_ptr<config_generation> newest;  // writer only: the cell to publish into
+    std::atomic<std::shared_ptr<config_generation const>> latest;  // where new workers start
+
+public:
+    explicit config_source(std::map<std::string, std::string> initial) :
+        newest(std::make_shared<config_generation>(std::move(initial))),
+        latest(newest)
+    {}
+
+    // safe while reload() runs: a worker starting from the previous generation follows its next
+    std::shared_ptr<config_generation const> current() const { return latest.load(); }
+
+    // one writer
+    void reload(std::map<std::string, std::string> settings)
+    {
+        auto next = std::make_shared<config_generation>(std::move(settings));
+        newest->next.publish(next);
+        newest = next;
+        latest.store(std::move(next));
+    }
+};
+
+bool do_work(config_generation const& config);
+
+void worker_thread(std::shared_ptr<config_generation const> config)
+{
+    for(;;)
+    {
+        if(auto const* next = config->next.try_get())
+        {
+            config = *next;     // reload published
+        }
+        if(!do_work(*config))
+        {
+            break;
+        }
+    }
+}
@@ -73,4 +73,322 @@ sleep_for() something need to be done periodically
 sleep_until() schedule a thread to wake
 std::timed_mutex supports timeouts
 same std::recursive_timed_mutex try_lock_for() and try lock until
-*/
\ No newline at end of file
+*/
+// ---------------------------------------------------------------------
+
+/*
+hierarchical timer wheel
+wait_loop above (and every future::wait_for) parks the thread on its own timed
+wait -> one kernel timer per timed operation, it doesn't scale to hundreds of
+thousands of in-flight request timeouts.
+timer_wheel: one timer thread for everybody, deadlines on steady_clock rounded up
+to a tick (1ms by default)
+- 4 levels of 256 slots: level 0 one slot per tick, level n one slot per 256^n
+  ticks -> 2^32 ticks (~49 days at 1ms), later deadlines wait in the last level
+  and are re-filed
+- add(): computes level + slot from the distance to the deadline, links the timer
+  in the slot's list -> O(1)
+- cancel(): unlinks by handle -> O(1); timers live in a vector indexed by the
+  handle, the generation in the handle makes stale handles harmless
+- every tick the timer thread fires level 0's slot, when level 0 wraps the next
+  slot of level 1 is cascaded down (and so on up the levels)
+- callbacks run on the timer thread outside the lock: keep them short (set a flag,
+  notify, fail a promise, post to a pool)
+*/
+
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+class timer_wheel
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    struct handle
+    {
+        std::uint32_t index = none;
+        std::uint32_t generation = 0;
+    };
+
+private:
+    static constexpr std::uint32_t none = ~std::uint32_t(0);
+    static constexpr unsigned slot_bits = 8;
+    static constexpr unsigned slots_per_level = 1u << slot_bits;
+    static constexpr unsigned levels = 4;
+
+    struct timer
+    {
+        std::function<void()> callback;
+        std::uint64_t expiry = 0;       // in ticks
+        std::uint32_t prev = none;
+        std::uint32_t next = none;      // also links the free list
+        std::uint32_t generation = 0;
+        std::uint16_t bucket = 0;       // level * slots_per_level + slot
+        bool linked = false;            // false once fired: the callback is due or running
+    };
+
+    clock::duration const resolution;
+    clock::time_point const start;
+
+    std::mutex m;
+    std::condition_variable timers_added;
+    std::condition_variable callback_done;
+    std::vector<timer> timers;
+    std::uint32_t free_list = none;
+    std::uint32_t buckets[levels * slots_per_level];
+    std::uint64_t current = 0;  // last processed tick
+    std::size_t active = 0;
+    bool stop = false;
+    std::thread timer_thread;
+
+    // deadlines round up and the current time rounds down: never fire early
+    std::uint64_t deadline_ticks(clock::time_point t) const
+    {
+        return t <= start ? 0 : std::uint64_t((t - start + resolution - clock::duration(1)) / resolution);
+    }
+
+    std::uint64_t elapsed_ticks(clock::time_point t) const
+    {
+        return std::uint64_t((t - start) / resolution);
+    }
+
+    // m must be held for all of the below
+
+    void link(std::uint32_t index)
+    {
+        timer& t = timers[index];
+        std::uint64_t const expiry = t.expiry > current ? t.expiry : current + 1;
+        std::uint64_t delta = expiry - current;
+        std::uint64_t position = expiry;
+        unsigned level = 0;
+        while(level + 1 < levels && delta >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+        {
+            ++level;
+        }
+        std::uint64_t const level_limit = std::uint64_t(1) << (slot_bits * levels);
+        if(delta >= level_limit)
+        {
+            position = current + level_limit - 1;  // too far: park in the last level, refiled when cascaded
+        }
+        unsigned const bucket = level * slots_per_level + unsigned((position >> (slot_bits * level)) & (slots_per_level - 1));
+        t.bucket = std::uint16_t(bucket);
+        t.prev = none;
+        t.next = buckets[bucket];
+        if(t.next != none)
+        {
+            timers[t.next].prev = index;
+        }
+        buckets[bucket] = index;
+        t.linked = true;
+    }
+
+    void unlink(std::uint32_t index)
+    {
+        timer& t = timers[index];
+        if(t.prev != none)
+        {
+            timers[t.prev].next = t.next;
+        }
+        else
+        {
+            buckets[t.bucket] = t.next;
+        }
+        if(t.next != none)
+        {
+            timers[t.next].prev = t.prev;
+        }
+        t.linked = false;
+    }
+
+    void free_timer(std::uint32_t index)
+    {
+        timer& t = timers[index];
+        ++t.generation;     // outstanding handles become stale
+        t.next = free_list;
+        free_list = index;
+        --active;
+    }
+
+    void cascade(unsigned level)
+    {
+        unsigned const bucket = level * slots_per_level + unsigned((current >> (slot_bits * level)) & (slots_per_level - 1));
+        std::uint32_t index = buckets[bucket];
+        buckets[bucket] = none;
+        while(index != none)
+        {
+            std::uint32_t const next = timers[index].next;
+            link(index);    // closer now: lands in a lower level
+            index = next;
+        }
+    }
+
+    // advances one tick, moves the timers due into fired.
+    // they stay allocated (same generation) until their callback has run
+    void advance(std::vector<std::uint32_t>& fired)
+    {
+        ++current;
+        if((current & (slots_per_level - 1)) == 0)
+        {
+            unsigned top = 1;
+            while(top + 1 < levels && ((current >> (slot_bits * top)) & (slots_per_level - 1)) == 0)
+            {
+                ++top;
+            }
+            for(unsigned level = top; level > 0; --level)
+            {
+                cascade(level);
+            }
+        }
+        unsigned const bucket = unsigned(current & (slots_per_level - 1));
+        std::uint32_t index = buckets[bucket];
+        buckets[bucket] = none;
+        while(index != none)
+        {
+            timer& t = timers[index];
+            std::uint32_t const next = t.next;
+            t.linked = false;
+            fired.push_back(index);
+            index = next;
+        }
+    }
+
+    void run()
+    {
+        std::vector<std::uint32_t> fired;
+        std::unique_lock<std::mutex> lk(m);
+        while(!stop)
+        {
+            if(active == 0)
+            {
+                current = elapsed_ticks(clock::now());   // nothing to fire: skip the idle ticks
+                timers_added.wait(lk);
+                continue;
+            }
+            std::uint64_t const now = elapsed_ticks(clock::now());
+            while(current < now && fired.empty())
+            {
+                advance(fired);
+            }
+            if(fired.empty())
+            {
+                timers_added.wait_until(lk, start + resolution * (current + 1));
+                continue;
+            }
+            for(std::uint32_t const index : fired)
+            {
+                std::function<void()> callback = std::move(timers[index].callback);
+                timers[index].callback = nullptr;
+                lk.unlock();
+                callback();
+                lk.lock();
+                free_timer(index);      // only now outstanding handles become stale
+            }
+            fired.clear();
+            callback_done.notify_all();
+        }
+    }
+
+public:
+    explicit timer_wheel(clock::duration resolution_ = std::chrono::milliseconds(1)) :
+        resolution(resolution_), start(clock::now())
+    {
+        for(auto& b : buckets)
+        {
+            b = none;
+        }
+        timer_thread = std::thread(&timer_wheel::run, this);
+    }
+
+    ~timer_wheel()
+    {
+        {
+            std::lock_guard<std::mutex> lk(m);
+            stop = true;
+        }
+        timers_added.notify_one();
+        timer_thread.join();    // pending timers are dropped without running
+    }
+
+    timer_wheel(timer_wheel const&) = delete;
+    timer_wheel& operator= (timer_wheel const&) = delete;
+
+    handle add(clock::time_point deadline, std::function<void()> callback)
+    {
+        std::uint64_t const expiry = deadline_ticks(deadline);
+        std::lock_guard<std::mutex> lk(m);
+        std::uint32_t index = free_list;
+        if(index != none)
+        {
+            free_list = timers[index].next;
+        }
+        else
+        {
+            index = std::uint32_t(timers.size());
+            timers.emplace_back();
+        }
+        timer& t = timers[index];
+        t.callback = std::move(callback);
+        t.expiry = expiry;
+        link(index);
+        if(++active == 1)
+        {
+            timers_added.notify_one();  // timer thread sleeps without deadline when idle
+        }
+        return handle{index, t.generation};
+    }
+
+    template<typename Rep, typename Period>
+    handle add(std::chrono::duration<Rep, Period> timeout, std::function<void()> callback)
+    {
+        return add(clock::now() + std::chrono::duration_cast<clock::duration>(timeout), std::move(callback));
+    }
+
+    // true if the timer was removed before firing.
+    // false if it already fired: when its callback is due or still running cancel waits
+    // for it (except when called from a callback), so afterwards nothing it uses is touched
+    bool cancel(handle h)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        if(h.index >= timers.size() || timers[h.index].generation != h.generation)
+        {
+            return false;   // fired and finished long ago
+        }
+        if(timers[h.index].linked)
+        {
+            unlink(h.index);
+            timers[h.index].callback = nullptr;
+            free_timer(h.index);
+            return true;
+        }
+        if(std::this_thread::get_id() != timer_thread.get_id())
+        {
+            callback_done.wait(lk, [&]{ return timers[h.index].generation != h.generation; });
+        }
+        return false;
+    }
+};
+
+// wait_loop without a timed wait per thread: the wheel wakes us up
+bool wait_loop(timer_wheel& timers)
+{
+    bool timed_out = false;     // protected by m
+    timer_wheel::handle const timeout = timers.add(std::chrono::milliseconds(500), [&]{
+        std::lock_guard<std::mutex> lk(m);
+        timed_out = true;
+        cv.notify_all();
+    });
+    std::unique_lock<std::mutex> lk(m);
+    cv.wait(lk, [&]{ return done || timed_out; });
+    bool const res = done;
+    lk.unlock();
+    timers.cancel(timeout);     // callback may not touch timed_out after this
+    return res;
+}
+
+/*
+same for futures and queue pops, the callback fails the waiter:
+auto h = timers.add(deadline, [p]{ p->set_exception(std::make_exception_ptr(request_timeout())); });
+and the normal completion path calls timers.cancel(h)
+*/
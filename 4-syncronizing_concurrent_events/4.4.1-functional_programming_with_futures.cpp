@@ -49,7 +49,155 @@ std::list<T> parallel_quick_sort(std::list<T> input)
     return result;
 }
 
+/*
+std::list version: every partition walks nodes scattered in memory and every
+level splices lists -> bad for cache.
+Same functional interface (take by value, return the sorted copy) on a std::vector:
+- partition in place, no allocation per level
+- median of three (ninther for big ranges) as pivot -> no worst case on sorted input
+- insertion sort for small ranges, recursion overhead bigger than the work
+- below a threshold no task is spawned, a task for few elements costs more than it saves
+*/
+
+#include <vector>
+#include <algorithm>
+#include <iterator>
 #include <future>
+#include <thread>
+
+std::size_t const insertion_sort_cutoff = 32;
+std::size_t const sequential_threshold = 1 << 14;
+
+template<typename Iterator>
+void insertion_sort(Iterator first, Iterator last)
+{
+    if(first == last)
+    {
+        return;
+    }
+    for(auto it = std::next(first); it != last; ++it)
+    {
+        auto value = std::move(*it);
+        auto hole = it;
+        while(hole != first && value < *std::prev(hole))
+        {
+            *hole = std::move(*std::prev(hole));
+            --hole;
+        }
+        *hole = std::move(value);
+    }
+}
+
+// sorts *a, *b, *c
+template<typename Iterator>
+void sort3(Iterator a, Iterator b, Iterator c)
+{
+    if(*b < *a) std::iter_swap(a, b);
+    if(*c < *b) std::iter_swap(b, c);
+    if(*b < *a) std::iter_swap(a, b);
+}
+
+// moves the pivot to *first
+template<typename Iterator>
+void choose_pivot(Iterator first, Iterator last)
+{
+    auto const length = last - first;
+    auto const mid = first + length / 2;
+    if(length > 128) // ninther: median of three medians of three
+    {
+        auto const step = length / 8;
+        sort3(first, first + step, first + 2 * step);
+        sort3(mid - step, mid, mid + step);
+        sort3(last - 1 - 2 * step, last - 1 - step, last - 1);
+        sort3(first + step, mid, last - 1 - step);
+    }
+    else
+    {
+        sort3(first, mid, last - 1);
+    }
+    std::iter_swap(first, mid);
+}
+
+// Hoare partition around *first, returns the final position of the pivot
+template<typename Iterator>
+Iterator partition_in_place(Iterator first, Iterator last)
+{
+    auto const& pivot = *first;
+    Iterator i = first;
+    Iterator j = last;
+    while(true)
+    {
+        while(*++i < pivot && i != last - 1);
+        while(pivot < *--j);
+        if(!(i < j))
+        {
+            break;
+        }
+        std::iter_swap(i, j);
+    }
+    std::iter_swap(first, j);
+    return j;
+}
+
+template<typename Iterator>
+void quick_sort_range(Iterator first, Iterator last)
+{
+    while(static_cast<std::size_t>(last - first) > insertion_sort_cutoff)
+    {
+        choose_pivot(first, last);
+        Iterator const divide_point = partition_in_place(first, last);
+        // recurse on the smaller part, loop on the bigger one -> stack depth O(log n)
+        if(divide_point - first < last - divide_point)
+        {
+            quick_sort_range(first, divide_point);
+            first = divide_point + 1;
+        }
+        else
+        {
+            quick_sort_range(divide_point + 1, last);
+            last = divide_point;
+        }
+    }
+    insertion_sort(first, last);
+}
+
+// spawn_depth bounds the number of tasks: at most 2^spawn_depth, not one per partition
+template<typename Iterator>
+void parallel_quick_sort_range(Iterator first, Iterator last, unsigned spawn_depth)
+{
+    if(!spawn_depth || static_cast<std::size_t>(last - first) <= sequential_threshold)
+    {
+        quick_sort_range(first, last);
+        return;
+    }
+    choose_pivot(first, last);
+    Iterator const divide_point = partition_in_place(first, last);
+    // the two parts are disjoint ranges of the same vector -> no data race, nothing to merge
+    std::future<void> lower(std::async(std::launch::async,
+        &parallel_quick_sort_range<Iterator>, first, divide_point, spawn_depth - 1));
+    parallel_quick_sort_range(divide_point + 1, last, spawn_depth - 1);
+    lower.get();
+}
+
+template<typename T>
+std::vector<T> sequential_quick_sort(std::vector<T> input)
+{
+    quick_sort_range(input.begin(), input.end());
+    return input;
+}
+
+template<typename T>
+std::vector<T> parallel_quick_sort(std::vector<T> input)
+{
+    unsigned const hardware_threads = std::thread::hardware_concurrency();
+    unsigned spawn_depth = 0;
+    while((1u << spawn_depth) < 4 * (hardware_threads != 0 ? hardware_threads : 2)) // some slack for unbalanced partitions
+    {
+        ++spawn_depth;
+    }
+    parallel_quick_sort_range(input.begin(), input.end(), spawn_depth);
+    return input; // moved out, no copy
+}
 
 // example of packaged task
 template<typename F,typename A>
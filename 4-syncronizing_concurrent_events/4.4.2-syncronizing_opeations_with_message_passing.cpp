@@ -59,4 +59,560 @@ public:
     }
 };
 
-// the design is very simple 
\ No newline at end of file
+// the design is very simple 
+
+/*
+M:N actor runtime
+
+with run() every atm needs its own thread, blocked in incoming.wait() most of
+the time: ten thousand state machines -> ten thousand threads.
+Instead:
+- each actor has a mailbox, sending a message never blocks
+- a fixed pool of worker threads runs the actors that have messages
+- an actor is scheduled when a message arrives in an empty mailbox and it
+  occupies a worker only while it has messages (at most a batch, then it goes
+  back in the run queue so it can't starve the others)
+- states don't wait: each state gets the current message and handles it, or
+  ignores it, like the handle<>() chain of incoming.wait()
+- a close_queue message shuts the actor down, later messages are dropped
+- an exception thrown by a handler closes that actor only (on_error() is
+  called, the rest of its mailbox is dropped), the worker keeps running the
+  other actors
+*/
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace messaging
+{
+    struct message_base
+    {
+        virtual ~message_base() {}
+    };
+
+    template<typename Msg>
+    struct wrapped_message : message_base
+    {
+        Msg contents;
+        explicit wrapped_message(Msg const& contents_) : contents(contents_) {}
+    };
+
+    class close_queue {};
+
+    // non-blocking equivalent of incoming.wait().handle<...>(...):
+    // the message is already there, the first matching handler runs
+    class dispatcher
+    {
+        message_base* msg;
+        bool handled;
+    public:
+        explicit dispatcher(message_base& msg_) : msg(&msg_), handled(false) {}
+
+        template<typename Msg, typename Func>
+        dispatcher& handle(Func&& f)
+        {
+            if(!handled)
+            {
+                if(auto const wrapper = dynamic_cast<wrapped_message<Msg>*>(msg))
+                {
+                    handled = true;
+                    f(wrapper->contents);
+                }
+            }
+            return *this;
+        }
+    };
+
+    class actor_runtime;
+
+    // anything the runtime can run: it handles up to batch_size messages per run
+    class schedulable : public std::enable_shared_from_this<schedulable>
+    {
+    private:
+        friend class actor_runtime;
+        virtual void run_batch() = 0;
+
+    protected:
+        static unsigned const batch_size = 32;
+
+        // receive() or on_close() threw: the actor is already closed
+        virtual void on_error(std::exception_ptr e)
+        {
+            try
+            {
+                std::rethrow_exception(e);
+            }
+            catch(std::exception const& ex)
+            {
+                std::cerr << "actor closed after an exception: " << ex.what() << std::endl;
+            }
+            catch(...)
+            {
+                std::cerr << "actor closed after an unknown exception" << std::endl;
+            }
+        }
+
+    public:
+        virtual ~schedulable() {}
+    };
+
+    class actor : public schedulable
+    {
+    private:
+        actor_runtime& runtime;
+        std::mutex mailbox_mutex;
+        std::deque<std::unique_ptr<message_base> > mailbox;
+        bool scheduled = false;   // in the run queue or running, protected by mailbox_mutex
+        bool closed = false;      // only touched by the worker running the actor
+
+        void run_batch() override;
+
+    protected:
+        // called for each message, by one worker at a time
+        virtual void receive(message_base& msg) = 0;
+        virtual void on_close() {}
+
+    public:
+        explicit actor(actor_runtime& runtime_) : runtime(runtime_) {}
+
+        template<typename Msg>
+        void send(Msg const& msg);
+    };
+
+    class actor_runtime
+    {
+    private:
+        friend class actor;
+        template<typename... Msgs>
+        friend class typed_actor;
+
+        std::mutex run_mutex;
+        std::condition_variable run_cond;
+        std::deque<std::shared_ptr<schedulable> > run_queue;
+        bool done = false;
+        std::vector<std::thread> workers;
+
+        void schedule(std::shared_ptr<schedulable> a)
+        {
+            {
+                std::lock_guard<std::mutex> lk(run_mutex);
+                run_queue.push_back(std::move(a));
+            }
+            run_cond.notify_one();
+        }
+
+        void worker_thread()
+        {
+            for(;;)
+            {
+                std::shared_ptr<schedulable> a;
+                {
+                    std::unique_lock<std::mutex> lk(run_mutex);
+                    run_cond.wait(lk, [this]{return done || !run_queue.empty();}); // idle workers sleep
+                    if(run_queue.empty())
+                    {
+                        return;
+                    }
+                    a = std::move(run_queue.front());
+                    run_queue.pop_front();
+                }
+                try
+                {
+                    a->run_batch();     // handler exceptions are caught per message in there
+                }
+                catch(...)
+                {
+                    // e.g. bad_alloc rescheduling: that actor is lost, not the worker
+                    std::cerr << "actor runtime: exception escaped run_batch()" << std::endl;
+                }
+            }
+        }
+
+    public:
+        explicit actor_runtime(unsigned num_workers = std::thread::hardware_concurrency())
+        {
+            if(!num_workers)
+            {
+                num_workers = 2;
+            }
+            for(unsigned i = 0; i < num_workers; ++i)
+            {
+                workers.push_back(std::thread(&actor_runtime::worker_thread, this));
+            }
+        }
+
+        // workers finish the actors already scheduled, then exit
+        ~actor_runtime()
+        {
+            {
+                std::lock_guard<std::mutex> lk(run_mutex);
+                done = true;
+            }
+            run_cond.notify_all();
+            for(auto& w : workers)
+            {
+                w.join();
+            }
+        }
+
+        template<typename Actor, typename... Args>
+        std::shared_ptr<Actor> spawn(Args&&... args)
+        {
+            return std::make_shared<Actor>(*this, std::forward<Args>(args)...);
+        }
+    };
+
+    template<typename Msg>
+    void actor::send(Msg const& msg)
+    {
+        std::unique_ptr<message_base> wrapped(new wrapped_message<Msg>(msg));
+        bool must_schedule = false;
+        {
+            std::lock_guard<std::mutex> lk(mailbox_mutex);
+            mailbox.push_back(std::move(wrapped));
+            must_schedule = !scheduled;
+            scheduled = true;
+        }
+        if(must_schedule)   // first message in an idle actor
+        {
+            runtime.schedule(shared_from_this());
+        }
+    }
+
+    inline void actor::run_batch()
+    {
+        for(unsigned i = 0; i < batch_size; ++i)
+        {
+            std::unique_ptr<message_base> msg;
+            {
+                std::lock_guard<std::mutex> lk(mailbox_mutex);
+                if(mailbox.empty())
+                {
+                    scheduled = false;  // the next send schedules it again
+                    return;
+                }
+                msg = std::move(mailbox.front());
+                mailbox.pop_front();
+            }
+            if(closed)
+            {
+                continue;   // drain and drop
+            }
+            try
+            {
+                if(dynamic_cast<wrapped_message<close_queue>*>(msg.get()))
+                {
+                    closed = true;
+                    on_close();
+                    continue;
+                }
+                receive(*msg);
+            }
+            catch(...)
+            {
+                closed = true;  // the rest of the mailbox is dropped, scheduled is cleared once it is empty
+                on_error(std::current_exception());
+            }
+        }
+        runtime.schedule(shared_from_this());  // still has messages: back of the run queue
+    }
+}
+
+// the atm as an actor: the state is a member function pointer as before,
+// but it handles the message it receives instead of waiting for one
+
+class atm_actor : public messaging::actor
+{
+private:
+    std::shared_ptr<messaging::actor> bank;
+    std::shared_ptr<messaging::actor> interface_hardware;
+    void (atm_actor::*state)(messaging::message_base&);
+    std::string account;
+    std::string pin;
+
+    void waiting_for_card(messaging::message_base& msg)
+    {
+        messaging::dispatcher(msg).handle<card_inserted>
+        (
+            [&](card_inserted const& msg)
+            {
+                account = msg.account;
+                pin = "";
+                interface_hardware->send(display_enter_pin());
+                state = &atm_actor::getting_pin;
+            }
+        );
+    }
+    void getting_pin(messaging::message_base& msg);
+
+protected:
+    void receive(messaging::message_base& msg) override
+    {
+        (this->*state)(msg);
+    }
+
+public:
+    atm_actor(messaging::actor_runtime& runtime,
+        std::shared_ptr<messaging::actor> bank_,
+        std::shared_ptr<messaging::actor> interface_hardware_) :
+        messaging::actor(runtime),
+        bank(std::move(bank_)),
+        interface_hardware(std::move(interface_hardware_)),
+        state(&atm_actor::waiting_for_card)
+    {}
+
+    // what waiting_for_card() did on entry, before waiting
+    void start()
+    {
+        interface_hardware->send(display_enter_card());
+    }
+};
+
+// messaging::actor_runtime runtime(4);  // 4 threads for any number of atms
+// auto machine = runtime.spawn<atm_actor>(bank, hardware);
+// machine->start();
+// machine->send(card_inserted{"acc1234"});
+// machine->send(messaging::close_queue());
+
+/*
+allocation-free typed messages
+
+actor::send wraps every message in a heap allocated wrapped_message, and
+dispatcher::handle tries each handler in turn with a dynamic_cast.
+typed_actor<Msgs...> knows all the message types it accepts:
+- a message is a std::variant<close_queue, Msgs...>, stored by value in a
+  ring buffer of slots: no allocation per message (the buffer grows only when
+  it is full, in steady state it never does)
+- std::visit dispatches on the index of the variant (a jump table built at
+  compile time), the handler is chosen by overload resolution
+- sending a type not in Msgs... doesn't compile instead of being discarded
+*/
+
+#include <variant>
+#include <type_traits>
+#include <chrono>
+
+namespace messaging
+{
+    template<typename... Funcs>
+    struct overloaded : Funcs...
+    {
+        using Funcs::operator()...;
+    };
+    template<typename... Funcs>
+    overloaded(Funcs...) -> overloaded<Funcs...>;
+
+    // calls the handler taking the type held by msg, messages without a handler are ignored
+    template<typename Variant, typename... Handlers>
+    void match(Variant& msg, Handlers&&... handlers)
+    {
+        std::visit(overloaded{std::forward<Handlers>(handlers)..., [](auto const&){}}, msg);
+    }
+
+    template<typename... Msgs>
+    class typed_actor : public schedulable
+    {
+    public:
+        typedef std::variant<close_queue, Msgs...> message;
+
+    private:
+        actor_runtime& runtime;
+        std::mutex mailbox_mutex;
+        std::vector<message> slots;     // ring buffer: head, count
+        std::size_t head = 0;
+        std::size_t count = 0;
+        bool scheduled = false;
+        bool closed = false;
+
+        void grow()
+        {
+            std::vector<message> bigger(slots.size() * 2);
+            for(std::size_t i = 0; i < count; ++i)
+            {
+                bigger[i] = std::move(slots[(head + i) % slots.size()]);
+            }
+            slots.swap(bigger);
+            head = 0;
+        }
+
+        void run_batch() override
+        {
+            message msg;
+            for(unsigned i = 0; i < batch_size; ++i)
+            {
+                {
+                    std::lock_guard<std::mutex> lk(mailbox_mutex);
+                    if(!count)
+                    {
+                        scheduled = false;
+                        return;
+                    }
+                    msg = std::move(slots[head]);
+                    head = (head + 1) % slots.size();
+                    --count;
+                }
+                if(closed)
+                {
+                    continue;
+                }
+                try
+                {
+                    if(std::holds_alternative<close_queue>(msg))
+                    {
+                        closed = true;
+                        on_close();
+                        continue;
+                    }
+                    receive(msg);
+                }
+                catch(...)
+                {
+                    closed = true;
+                    on_error(std::current_exception());
+                }
+            }
+            runtime.schedule(shared_from_this());
+        }
+
+    protected:
+        virtual void receive(message& msg) = 0;
+        virtual void on_close() {}
+
+    public:
+        explicit typed_actor(actor_runtime& runtime_, std::size_t initial_capacity = 64) :
+            runtime(runtime_), slots(initial_capacity ? initial_capacity : 1)
+        {}
+
+        template<typename Msg>
+        void send(Msg&& msg)
+        {
+            typedef typename std::decay<Msg>::type msg_type;
+            static_assert(std::disjunction<std::is_same<msg_type, close_queue>, std::is_same<msg_type, Msgs>...>::value,
+                "message type not accepted by this actor");
+            bool must_schedule = false;
+            {
+                std::lock_guard<std::mutex> lk(mailbox_mutex);
+                if(count == slots.size())
+                {
+                    grow();
+                }
+                slots[(head + count) % slots.size()] = std::forward<Msg>(msg);  // constructed in place in the slot
+                ++count;
+                must_schedule = !scheduled;
+                scheduled = true;
+            }
+            if(must_schedule)
+            {
+                runtime.schedule(shared_from_this());
+            }
+        }
+    };
+}
+
+// example: the hardware interface receiving the display messages
+
+class interface_machine : public messaging::typed_actor<display_enter_card, display_enter_pin>
+{
+public:
+    using typed_actor::typed_actor;
+
+protected:
+    void receive(message& msg) override
+    {
+        messaging::match(msg,
+            [&](display_enter_card const&) { /* show "insert card" */ },
+            [&](display_enter_pin const&) { /* show "enter PIN" */ });
+    }
+};
+
+/*
+message rate benchmark: compile with -DCOUNT_ALLOCATIONS to count the heap
+allocations done while sending and handling the messages.
+expected: about one per message for actor, ~0 for typed_actor
+*/
+
+#ifdef COUNT_ALLOCATIONS
+#include <cstdlib>
+#include <new>
+std::atomic<unsigned long> allocation_count(0);
+void* operator new(std::size_t size)
+{
+    ++allocation_count;
+    if(void* p = std::malloc(size ? size : 1))
+    {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+#endif
+
+#include <iostream>
+
+struct ping { unsigned long value; };
+struct pong { unsigned long value; };
+
+class typed_counter : public messaging::typed_actor<ping, pong>
+{
+public:
+    std::atomic<unsigned long> received{0};
+    using typed_actor::typed_actor;
+protected:
+    void receive(message& msg) override
+    {
+        messaging::match(msg,
+            [&](ping const&) { received.fetch_add(1, std::memory_order_relaxed); },
+            [&](pong const&) { received.fetch_add(1, std::memory_order_relaxed); });
+    }
+};
+
+class erased_counter : public messaging::actor
+{
+public:
+    std::atomic<unsigned long> received{0};
+    using actor::actor;
+protected:
+    void receive(messaging::message_base& msg) override
+    {
+        messaging::dispatcher(msg)
+            .handle<ping>([&](ping const&) { received.fetch_add(1, std::memory_order_relaxed); })
+            .handle<pong>([&](pong const&) { received.fetch_add(1, std::memory_order_relaxed); });
+    }
+};
+
+template<typename Counter>
+void message_rate(messaging::actor_runtime& runtime, char const* name, unsigned long num_messages)
+{
+    auto const counter = runtime.spawn<Counter>();
+    counter->send(ping{0});     // warm up: mailbox and run queue reach their size
+    while(counter->received.load() != 1) {}
+#ifdef COUNT_ALLOCATIONS
+    unsigned long const allocations_before = allocation_count.load();
+#endif
+    auto const start = std::chrono::steady_clock::now();
+    for(unsigned long i = 0; i < num_messages; ++i)
+    {
+        if(i % 2) counter->send(pong{i});
+        else counter->send(ping{i});
+    }
+    while(counter->received.load() != num_messages + 1) {}
+    std::chrono::duration<double> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << name << ": " << num_messages / elapsed.count() << " messages/s";
+#ifdef COUNT_ALLOCATIONS
+    std::cout << ", " << double(allocation_count.load() - allocations_before) / num_messages << " allocations/message";
+#endif
+    std::cout << std::endl;
+}
+
+// messaging::actor_runtime runtime(1);
+// message_rate<erased_counter>(runtime, "actor", 1000000);
+// message_rate<typed_counter>(runtime, "typed_actor", 1000000);
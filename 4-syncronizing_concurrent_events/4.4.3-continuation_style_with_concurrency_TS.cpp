@@ -49,4 +49,390 @@ spawn_async(Func&& func){
     );
     t.detach();
     return res;
-}
\ No newline at end of file
+}
+
+/*
+spawn_async on a thread pool, with executor-aware continuations
+
+spawn_async above (and spawn_task in 4.4.1) create and detach a new thread for
+every call: for tasks of a few microseconds creating the thread costs more
+than the task.
+- thread_pool_executor: fixed threads taking tasks from a queue
+- spawn_async(executor, f): f is posted to the executor, no thread created
+- future.then(f): f runs inline on the thread that completes the future
+  (or on the caller if it is already ready), good for cheap continuations
+- future.then(executor, f): f is posted to the executor when the future is ready
+std::experimental::future is not available, so continuable_promise/future
+implement the part of it we need: the continuation gets the ready future.
+*/
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// move-only callable: continuations capture promises, std::function needs copyable objects
+class unique_function
+{
+    struct impl_base
+    {
+        virtual void call() = 0;
+        virtual ~impl_base() {}
+    };
+
+    template<typename F>
+    struct impl_type : impl_base
+    {
+        F f;
+        template<typename G>
+        explicit impl_type(G&& g) : f(std::forward<G>(g)) {}
+        void call() { f(); }
+    };
+
+    std::unique_ptr<impl_base> impl;
+
+public:
+    unique_function() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same<std::decay_t<F>, unique_function>::value> >
+    unique_function(F&& f) :
+        impl(new impl_type<std::decay_t<F> >(std::forward<F>(f)))
+    {}
+
+    unique_function(unique_function&&) = default;
+    unique_function& operator= (unique_function&&) = default;
+
+    explicit operator bool() const { return impl != nullptr; }
+    void operator() () { impl->call(); }
+};
+
+class thread_pool_executor
+{
+private:
+    std::mutex m;
+    std::condition_variable cond;
+    std::deque<unique_function> tasks;
+    bool done;
+    std::vector<std::thread> threads;
+
+    void worker_thread()
+    {
+        for(;;)
+        {
+            unique_function task;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                cond.wait(lock, [this]{return done || !tasks.empty();});
+                if(tasks.empty())
+                {
+                    return;     // done and nothing left to run
+                }
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            task();
+        }
+    }
+
+public:
+    explicit thread_pool_executor(unsigned num_threads = std::thread::hardware_concurrency()) :
+        done(false)
+    {
+        if(!num_threads)
+        {
+            num_threads = 2;
+        }
+        for(unsigned i = 0; i < num_threads; ++i)
+        {
+            threads.push_back(std::thread(&thread_pool_executor::worker_thread, this));
+        }
+    }
+
+    thread_pool_executor(thread_pool_executor const&) = delete;
+    thread_pool_executor& operator= (thread_pool_executor const&) = delete;
+
+    ~thread_pool_executor()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            done = true;
+        }
+        cond.notify_all();
+        for(auto& t : threads)
+        {
+            t.join();
+        }
+    }
+
+    void post(unique_function task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m);
+            tasks.push_back(std::move(task));
+        }
+        cond.notify_one();
+    }
+};
+
+// runs the task right away, on the calling thread
+struct inline_executor
+{
+    void post(unique_function task)
+    {
+        task();
+    }
+};
+
+template<typename T>
+class continuable_future;
+
+template<typename T>
+class continuable_promise;
+
+namespace detail
+{
+    template<typename T>
+    struct shared_state
+    {
+        typedef std::conditional_t<std::is_void<T>::value, std::monostate, T> value_type;
+
+        std::mutex m;
+        std::condition_variable cond;
+        bool ready = false;
+        std::optional<value_type> value;
+        std::exception_ptr error;
+        unique_function continuation;
+
+        void make_ready()
+        {
+            unique_function c;
+            {
+                std::lock_guard<std::mutex> lock(m);
+                ready = true;
+                c = std::move(continuation);
+            }
+            cond.notify_all();
+            if(c)
+            {
+                c();    // runs on the thread completing the future
+            }
+        }
+
+        void set_continuation(unique_function c)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m);
+                if(!ready)
+                {
+                    continuation = std::move(c);
+                    return;
+                }
+            }
+            c();    // already ready: run now
+        }
+
+        void wait()
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cond.wait(lock, [this]{return ready;});
+        }
+    };
+
+    // calls f and stores its result or exception in p
+    template<typename R, typename F, typename... Args>
+    void fulfil(continuable_promise<R>& p, F& f, Args&&... args)
+    {
+        try
+        {
+            if constexpr (std::is_void<R>::value)
+            {
+                f(std::forward<Args>(args)...);
+                p.set_value();
+            }
+            else
+            {
+                p.set_value(f(std::forward<Args>(args)...));
+            }
+        }
+        catch(...)
+        {
+            p.set_exception(std::current_exception());
+        }
+    }
+}
+
+template<typename T>
+class continuable_promise
+{
+private:
+    std::shared_ptr<detail::shared_state<T> > state;
+
+    // a promise dropped before being satisfied makes its future ready with
+    // broken_promise: get()/wait() return and the stored continuation runs
+    // (and is released, it holds a reference to the state)
+    void abandon()
+    {
+        if(!state)
+        {
+            return;     // moved from
+        }
+        {
+            std::lock_guard<std::mutex> lock(state->m);
+            if(state->ready)
+            {
+                return;
+            }
+        }
+        set_exception(std::make_exception_ptr(std::future_error(std::future_errc::broken_promise)));
+    }
+
+public:
+    continuable_promise() : state(std::make_shared<detail::shared_state<T> >()) {}
+    continuable_promise(continuable_promise&&) = default;
+
+    continuable_promise& operator= (continuable_promise&& other)
+    {
+        if(this != &other)
+        {
+            abandon();
+            state = std::move(other.state);
+        }
+        return *this;
+    }
+
+    ~continuable_promise()
+    {
+        abandon();
+    }
+
+    continuable_future<T> get_future()
+    {
+        return continuable_future<T>(state);
+    }
+
+    template<typename... V>
+    void set_value(V&&... v)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->m);
+            state->value.emplace(std::forward<V>(v)...);
+        }
+        state->make_ready();
+    }
+
+    void set_exception(std::exception_ptr e)
+    {
+        {
+            std::lock_guard<std::mutex> lock(state->m);
+            state->error = e;
+        }
+        state->make_ready();
+    }
+};
+
+template<typename T>
+class continuable_future
+{
+private:
+    template<typename U>
+    friend class continuable_promise;
+
+    std::shared_ptr<detail::shared_state<T> > state;
+
+    explicit continuable_future(std::shared_ptr<detail::shared_state<T> > state_) :
+        state(std::move(state_))
+    {}
+
+    template<typename Executor, typename Func>
+    auto then_impl(Executor* executor, Func&& func)
+    {
+        typedef decltype(func(std::declval<continuable_future<T> >())) result_type;
+        continuable_promise<result_type> p;
+        continuable_future<result_type> res = p.get_future();
+        auto s = std::move(state);  // like the TS: this future becomes invalid
+        auto run = [p = std::move(p), f = std::decay_t<Func>(std::forward<Func>(func)), s]() mutable
+        {
+            detail::fulfil(p, f, continuable_future<T>(s));
+        };
+        if(executor)
+        {
+            s->set_continuation([executor, run = std::move(run)]() mutable { executor->post(std::move(run)); });
+        }
+        else
+        {
+            s->set_continuation(std::move(run));
+        }
+        return res;
+    }
+
+public:
+    continuable_future() = default;
+    continuable_future(continuable_future&&) = default;
+    continuable_future& operator= (continuable_future&&) = default;
+
+    bool valid() const { return state != nullptr; }
+
+    bool is_ready() const
+    {
+        std::lock_guard<std::mutex> lock(state->m);
+        return state->ready;
+    }
+
+    void wait() const { state->wait(); }
+
+    T get()
+    {
+        state->wait();
+        auto s = std::move(state);  // value can be retrieved only once
+        if(s->error)
+        {
+            std::rethrow_exception(s->error);
+        }
+        if constexpr (!std::is_void<T>::value)
+        {
+            return std::move(*s->value);
+        }
+    }
+
+    // cheap continuation: inline on the completing thread
+    template<typename Func>
+    auto then(Func&& func)
+    {
+        return then_impl(static_cast<inline_executor*>(nullptr), std::forward<Func>(func));
+    }
+
+    // the executor must outlive the future
+    template<typename Executor, typename Func>
+    auto then(Executor& executor, Func&& func)
+    {
+        return then_impl(&executor, std::forward<Func>(func));
+    }
+};
+
+template<typename Executor, typename Func>
+continuable_future<decltype(std::declval<Func>()())>
+spawn_async(Executor& executor, Func&& func)
+{
+    typedef decltype(std::declval<Func>()()) result_type;
+    continuable_promise<result_type> p;
+    auto res = p.get_future();
+    executor.post(
+        [p = std::move(p), f = std::decay_t<Func>(std::forward<Func>(func))]() mutable
+        {
+            detail::fulfil(p, f);
+        });
+    return res;
+}
+
+// thread_pool_executor pool;
+// auto fut = spawn_async(pool, find_the_answer)
+//     .then([](continuable_future<int> answer){ return answer.get() * 2; })          // inline
+//     .then(pool, [](continuable_future<int> doubled){ return expensive(doubled.get()); }); // posted to pool
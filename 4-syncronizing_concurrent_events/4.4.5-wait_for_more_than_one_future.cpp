@@ -117,4 +117,381 @@ std::experimental::future<std::string> f2 = spawn_async(func2);
 std::experimental::future<double> f3 = spawn_async(func3);
 // we need to use a tuple of futures
 std::experimental::future<std::tuple<std::experimental::future<int>, std::experimental::future<std::string>, std::experimental::future<double>>> 
-    result = std::experimental::when_all(std::move(f1),std::move(f2),std::move(f3));
\ No newline at end of file
+    result = std::experimental::when_all(std::move(f1),std::move(f2),std::move(f3));
+
+/*
+when_all and when_any without waiter threads
+
+std::experimental::when_all/when_any are not in our toolchain, and the usual
+fallback is a helper thread blocked on each future in turn.
+Built on continuable_future/continuable_promise (4.4.3): every input future
+gets an inline continuation, so nothing ever blocks:
+- when_all: an atomic countdown shared by the continuations, the one that brings
+  it to zero (last to complete) makes the result ready
+- when_any: each input is forwarded into a new future that goes in the result;
+  the first continuation that wins a CAS on a flag makes the result ready,
+  with the index of its future
+n futures -> n continuations and O(n) atomic operations, zero blocked threads.
+Both in iterator-range and variadic form, like the TS.
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace detail
+{
+    // moves the value or the exception of a ready future into p
+    template<typename T>
+    void forward_result(continuable_promise<T>& p, continuable_future<T>& ready)
+    {
+        auto get = [&ready]{ return ready.get(); };
+        fulfil(p, get);
+    }
+
+    template<typename Sequence>
+    struct when_all_context
+    {
+        std::atomic<std::size_t> remaining;
+        Sequence futures;
+        continuable_promise<Sequence> promise;
+
+        when_all_context(std::size_t count) : remaining(count) {}
+
+        void completed()
+        {
+            if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) // last one: all the writes are visible
+            {
+                promise.set_value(std::move(futures));
+            }
+        }
+    };
+}
+
+template<typename Iterator>
+continuable_future<std::vector<typename std::iterator_traits<Iterator>::value_type> >
+when_all(Iterator first, Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type future_type;
+    typedef std::vector<future_type> sequence;
+    std::size_t const count = std::distance(first, last);
+    auto ctx = std::make_shared<detail::when_all_context<sequence> >(count);
+    ctx->futures.resize(count);
+    auto res = ctx->promise.get_future();
+    if(!count)
+    {
+        ctx->promise.set_value(sequence());
+        return res;
+    }
+    for(std::size_t i = 0; first != last; ++first, ++i)
+    {
+        // each continuation writes only its own slot
+        std::move(*first).then([ctx, i](future_type ready)
+        {
+            ctx->futures[i] = std::move(ready);
+            ctx->completed();
+        });
+    }
+    return res;
+}
+
+template<typename... Futures>
+continuable_future<std::tuple<std::decay_t<Futures>...> >
+when_all(Futures&&... futures)
+{
+    typedef std::tuple<std::decay_t<Futures>...> sequence;
+    auto ctx = std::make_shared<detail::when_all_context<sequence> >(sizeof...(Futures));
+    auto res = ctx->promise.get_future();
+    if constexpr (sizeof...(Futures) == 0)
+    {
+        ctx->promise.set_value(sequence());
+    }
+    else
+    {
+        auto attach = [&ctx](auto index, auto&& input)
+        {
+            typedef std::decay_t<decltype(input)> future_type;
+            std::move(input).then([ctx](future_type ready)
+            {
+                std::get<decltype(index)::value>(ctx->futures) = std::move(ready);
+                ctx->completed();
+            });
+        };
+        [&]<std::size_t... I>(std::index_sequence<I...>)
+        {
+            (attach(std::integral_constant<std::size_t, I>(), std::move(futures)), ...);
+        }(std::index_sequence_for<Futures...>());
+    }
+    return res;
+}
+
+template<typename Sequence>
+struct when_any_result
+{
+    std::size_t index;
+    Sequence futures;
+};
+
+namespace detail
+{
+    template<typename Sequence>
+    struct when_any_context
+    {
+        std::atomic<bool> fired{false};
+        Sequence futures;   // forwarded futures, handed to the result by the winner
+        continuable_promise<when_any_result<Sequence> > promise;
+
+        void completed(std::size_t index)
+        {
+            bool expected = false;
+            if(fired.compare_exchange_strong(expected, true, std::memory_order_acq_rel)) // first completer wins
+            {
+                promise.set_value(when_any_result<Sequence>{index, std::move(futures)});
+            }
+        }
+    };
+}
+
+template<typename Iterator>
+continuable_future<when_any_result<std::vector<typename std::iterator_traits<Iterator>::value_type> > >
+when_any(Iterator first, Iterator last)
+{
+    typedef typename std::iterator_traits<Iterator>::value_type future_type;
+    typedef decltype(std::declval<future_type>().get()) value_type;
+    typedef std::vector<future_type> sequence;
+    auto ctx = std::make_shared<detail::when_any_context<sequence> >();
+    auto res = ctx->promise.get_future();
+    std::vector<continuable_promise<value_type> > forwards(std::distance(first, last));
+    if(forwards.empty())
+    {
+        ctx->promise.set_value(when_any_result<sequence>{static_cast<std::size_t>(-1), sequence()});
+        return res;
+    }
+    // all the result futures must exist before the first continuation can fire
+    for(auto& p : forwards)
+    {
+        ctx->futures.push_back(p.get_future());
+    }
+    for(std::size_t i = 0; first != last; ++first, ++i)
+    {
+        std::move(*first).then([ctx, i, p = std::move(forwards[i])](future_type ready) mutable
+        {
+            detail::forward_result(p, ready);   // ready before the result is delivered
+            ctx->completed(i);
+        });
+    }
+    return res;
+}
+
+template<typename... Futures>
+continuable_future<when_any_result<std::tuple<std::decay_t<Futures>...> > >
+when_any(Futures&&... futures)
+{
+    typedef std::tuple<std::decay_t<Futures>...> sequence;
+    auto ctx = std::make_shared<detail::when_any_context<sequence> >();
+    auto res = ctx->promise.get_future();
+    if constexpr (sizeof...(Futures) == 0)
+    {
+        // nothing to wait for: ready right away, like the empty range
+        ctx->promise.set_value(when_any_result<sequence>{static_cast<std::size_t>(-1), sequence()});
+    }
+    else
+    {
+        auto attach = [&ctx](auto index, auto&& input)
+        {
+            typedef std::decay_t<decltype(input)> future_type;
+            typedef decltype(std::declval<future_type>().get()) value_type;
+            continuable_promise<value_type> p;
+            std::get<decltype(index)::value>(ctx->futures) = p.get_future();
+            return [ctx, p = std::move(p), input = std::move(input)]() mutable
+            {
+                std::move(input).then([ctx, p = std::move(p)](future_type ready) mutable
+                {
+                    detail::forward_result(p, ready);
+                    ctx->completed(decltype(index)::value);
+                });
+            };
+        };
+        [&]<std::size_t... I>(std::index_sequence<I...>)
+        {
+            // first create every forwarded future, then attach the continuations
+            auto attachers = std::make_tuple(attach(std::integral_constant<std::size_t, I>(), std::move(futures))...);
+            (std::get<I>(attachers)(), ...);
+        }(std::index_sequence_for<Futures...>());
+    }
+    return res;
+}
+
+// process_data with our futures: same shape as the TS version, no helper thread
+
+continuable_future<FinalResult> process_data(thread_pool_executor& pool, std::vector<MyData>& vec)
+{
+    size_t const chunk_size = whatever;
+    std::vector<continuable_future<ChunkResult> > results;
+    for(auto begin = vec.begin(), end = vec.end(); begin != end;)
+    {
+        size_t const remaining_size = end - begin;
+        size_t const this_chunk_size = std::min(remaining_size, chunk_size);
+        results.push_back(spawn_async(pool, [begin, this_chunk_size]{ return process_chunk(begin, begin + this_chunk_size); }));
+        begin += this_chunk_size;
+    }
+    return when_all(results.begin(), results.end()).then(
+        [](continuable_future<std::vector<continuable_future<ChunkResult> > > ready_results)
+        {
+            std::vector<continuable_future<ChunkResult> > all_results = ready_results.get();
+            std::vector<ChunkResult> v;
+            v.reserve(all_results.size());
+            for(auto& f : all_results)
+            {
+                v.push_back(f.get());
+            }
+            return gather_results(v);
+        });
+}
+
+
+/*
+cooperative cancellation for the parallel search
+
+find_and_process_value above polls a shared atomic<bool> on every element, and
+the tasks for the other chunks still run (or wait in the queue) after the value
+has been found.
+std::stop_source / std::stop_token (C++20) instead:
+- spawn_async(executor, token, f): a task still in the queue when stop is
+  requested is dropped, it is never run and its future gets operation_cancelled
+- f can take the token to check it while running, how often it checks is up to
+  the task: find_if_cancellable looks at it every check_interval elements,
+  not on every element
+- the chunk that finds the value calls request_stop(): only the first call
+  returns true, so it is also the one that processes the value
+- a chunk that fails does the same with its exception: the first error stops
+  the search and is rethrown by the final future
+*/
+
+#include <algorithm>
+#include <stop_token>
+#include <stdexcept>
+
+struct operation_cancelled : std::exception
+{
+    const char* what() const noexcept { return "operation cancelled"; }
+};
+
+template<typename Executor, typename Func>
+auto spawn_async(Executor& executor, std::stop_token token, Func&& func)
+{
+    constexpr bool takes_token = std::is_invocable<std::decay_t<Func>&, std::stop_token>::value;
+    typedef typename std::conditional_t<takes_token,
+        std::invoke_result<std::decay_t<Func>&, std::stop_token>,
+        std::invoke_result<std::decay_t<Func>&> >::type result_type;
+    continuable_promise<result_type> p;
+    auto res = p.get_future();
+    executor.post(
+        [p = std::move(p), token, f = std::decay_t<Func>(std::forward<Func>(func))]() mutable
+        {
+            if(token.stop_requested())  // cancelled while queued: drop it
+            {
+                p.set_exception(std::make_exception_ptr(operation_cancelled()));
+                return;
+            }
+            if constexpr (takes_token)
+            {
+                detail::fulfil(p, f, token);
+            }
+            else
+            {
+                detail::fulfil(p, f);
+            }
+        });
+    return res;
+}
+
+// std::find_if that gives up when stop is requested, checking the token every check_interval elements
+template<typename Iterator, typename Predicate>
+Iterator find_if_cancellable(Iterator first, Iterator last, Predicate pred,
+    std::stop_token token, std::size_t check_interval)
+{
+    std::size_t until_check = check_interval;
+    for(; first != last; ++first)
+    {
+        if(!--until_check)
+        {
+            if(token.stop_requested())
+            {
+                return last;
+            }
+            until_check = check_interval;
+        }
+        if(pred(*first))
+        {
+            return first;
+        }
+    }
+    return last;
+}
+
+continuable_future<FinalResult>
+find_and_process_value(thread_pool_executor& pool, std::vector<MyData>& data, std::size_t check_interval = 1024)
+{
+    if(check_interval == 0)
+    {
+        throw std::invalid_argument("check_interval must be at least 1");
+    }
+    unsigned const concurrency = std::thread::hardware_concurrency();
+    unsigned const num_tasks = (concurrency > 0) ? concurrency : 2;
+    auto const chunk_size = (data.size() + num_tasks - 1) / num_tasks;
+
+    struct search_state
+    {
+        std::stop_source stop;
+        continuable_promise<FinalResult> final_result;
+        std::atomic<unsigned> remaining;
+        search_state(unsigned tasks) : remaining(tasks) {}
+    };
+    auto state = std::make_shared<search_state>(num_tasks);
+    auto res = state->final_result.get_future();
+
+    auto chunk_begin = data.begin();
+    for(unsigned i = 0; i < num_tasks; ++i)
+    {
+        auto const chunk_end = (i < (num_tasks - 1)) ? chunk_begin + std::min<std::size_t>(chunk_size, data.end() - chunk_begin) : data.end();
+        spawn_async(pool, state->stop.get_token(),
+            [=](std::stop_token token)
+            {
+                auto const it = find_if_cancellable(chunk_begin, chunk_end, matches_find_criteria, token, check_interval);
+                return (it != chunk_end) ? &*it : (MyData*)nullptr;
+            }).then([state](continuable_future<MyData*> chunk_result)
+            {
+                MyData* found = nullptr;
+                try
+                {
+                    found = chunk_result.get();
+                }
+                catch(operation_cancelled const&)
+                {}
+                catch(...)
+                {
+                    if(state->stop.request_stop())  // first to finish the search, with an error
+                    {
+                        state->final_result.set_exception(std::current_exception());
+                    }
+                }
+                if(found && state->stop.request_stop())    // first to find it, the others are cancelled
+                {
+                    auto process = [found]{ return process_found_value(*found); };
+                    detail::fulfil(state->final_result, process);   // an exception goes into final_result
+                }
+                // reached by every chunk, whatever happened to it
+                if(state->remaining.fetch_sub(1) == 1 && !state->stop.stop_requested())
+                {
+                    state->final_result.set_exception(std::make_exception_ptr(std::runtime_error("Not found")));
+                }
+            });
+        chunk_begin = chunk_end;
+    }
+    return res;
+}
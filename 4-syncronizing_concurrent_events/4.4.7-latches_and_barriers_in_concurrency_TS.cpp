@@ -120,4 +120,284 @@ void process_data(data_source &source, data_sink &sink)
             }
         });
     }
-}
\ No newline at end of file
+}
+
+/*
+our own latch, barrier and flex_barrier (the TS ones are not in our toolchain)
+same member functions, so the examples above work replacing std::experimental::
+
+- latch: atomic counter, the thread bringing it to zero wakes the waiters
+- barrier: sense reversing. The phase number is the "sense": a thread arriving
+  reads the phase, decrements the counter; the last one resets the counter for
+  the next cycle and increments the phase, the others wait for the phase to
+  change. The counter can be reset right away because nobody waits on it.
+- flex_barrier: the last thread runs the completion function before releasing
+  the others; it returns -1 to keep the same number of threads, or the number
+  of threads for the next phase
+- waiting: spin for a while first, the phase usually changes within a few
+  microseconds in lock-step loops and going to sleep costs a syscall on both
+  sides; then park with std::atomic::wait (a futex on Linux)
+*/
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <thread>
+
+namespace detail
+{
+    unsigned const spin_count = 1000;
+
+    // returns when value != old
+    template<typename T>
+    void spin_then_wait(std::atomic<T> const& value, T old)
+    {
+        for(unsigned i = 0; i < spin_count; ++i)
+        {
+            if(value.load(std::memory_order_acquire) != old)
+            {
+                return;
+            }
+            if(i % 64 == 63)
+            {
+                std::this_thread::yield();  // don't starve the thread we are waiting for on oversubscribed cores
+            }
+        }
+        while(value.load(std::memory_order_acquire) == old)
+        {
+            value.wait(old, std::memory_order_acquire);
+        }
+    }
+}
+
+class latch
+{
+private:
+    std::atomic<std::ptrdiff_t> counter;
+
+public:
+    explicit latch(std::ptrdiff_t count) : counter(count) {}
+    latch(latch const&) = delete;
+    latch& operator= (latch const&) = delete;
+
+    void count_down(std::ptrdiff_t n = 1)
+    {
+        if(counter.fetch_sub(n, std::memory_order_release) == n)
+        {
+            counter.notify_all();
+        }
+    }
+
+    bool is_ready() const noexcept
+    {
+        return counter.load(std::memory_order_acquire) == 0;
+    }
+
+    void wait() const
+    {
+        for(std::ptrdiff_t c = counter.load(std::memory_order_acquire); c != 0; c = counter.load(std::memory_order_acquire))
+        {
+            detail::spin_then_wait(counter, c);
+        }
+    }
+
+    void count_down_and_wait()
+    {
+        count_down();
+        wait();
+    }
+};
+
+class flex_barrier
+{
+private:
+    std::atomic<std::ptrdiff_t> remaining;
+    std::atomic<std::ptrdiff_t> participants;
+    std::atomic<unsigned> phase;
+    std::function<std::ptrdiff_t()> completion;
+
+    // returns the phase the caller arrived in
+    unsigned arrive()
+    {
+        unsigned const current_phase = phase.load(std::memory_order_relaxed);
+        if(remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)   // last one
+        {
+            if(completion)
+            {
+                std::ptrdiff_t const next_count = completion();
+                if(next_count != -1)
+                {
+                    participants.store(next_count, std::memory_order_relaxed);
+                }
+            }
+            remaining.store(participants.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            phase.fetch_add(1, std::memory_order_release);  // flip the sense: releases the waiters
+            phase.notify_all();
+        }
+        return current_phase;
+    }
+
+public:
+    explicit flex_barrier(std::ptrdiff_t num_threads) :
+        remaining(num_threads), participants(num_threads), phase(0)
+    {}
+
+    template<typename Completion>
+    flex_barrier(std::ptrdiff_t num_threads, Completion completion_) :
+        remaining(num_threads), participants(num_threads), phase(0),
+        completion(std::move(completion_))
+    {}
+
+    flex_barrier(flex_barrier const&) = delete;
+    flex_barrier& operator= (flex_barrier const&) = delete;
+
+    void arrive_and_wait()
+    {
+        unsigned const arrived_phase = arrive();
+        detail::spin_then_wait(phase, arrived_phase);
+    }
+
+    // leaves the synchronization group, from the next phase on we wait for one thread less
+    void arrive_and_drop()
+    {
+        participants.fetch_sub(1, std::memory_order_relaxed);
+        arrive();
+    }
+};
+
+// barrier: flex_barrier without the completion function
+class barrier : private flex_barrier
+{
+public:
+    explicit barrier(std::ptrdiff_t num_threads) : flex_barrier(num_threads) {}
+    using flex_barrier::arrive_and_wait;
+    using flex_barrier::arrive_and_drop;
+};
+
+
+/*
+pipelined process_data
+
+in both versions above reading the next block and writing the result are done
+by one thread (thread 0 or the completion function) while all the others sit
+at the barrier: with slow I/O the workers are idle a good part of the time.
+pipeline with num_buffers rotating slots, block k uses slot k % num_buffers:
+- a reader thread reads block k+1, k+2... into free slots
+- the workers process the chunks of block k, the last one to finish its chunk
+  passes the slot to the writer
+- a writer thread writes the result of block k-1 and frees its slot
+so reading, processing and writing of consecutive blocks overlap. With 3
+buffers each stage can be one block ahead of the next one.
+each slot carries a tag = block number + state, the tag goes
+(k, empty) -> (k, filled) -> (k, processed) -> (k + num_buffers, empty),
+each transition is an atomic store + notify, waiting uses atomic wait.
+every stage waits for the block it wants, not just for a state: a fast worker
+that wrapped around to block k + num_buffers must not take the chunks of block k
+that slower workers are still processing.
+*/
+
+#include <stdexcept>
+#include <vector>
+
+enum class slot_state : unsigned long { empty, filled, processed, end_of_data };
+
+struct pipeline_slot
+{
+    std::atomic<unsigned long> tag{0};   // block << 2 | slot_state
+    std::vector<data_chunk> chunks;
+    result_block result;
+    std::atomic<unsigned> chunks_left{0};
+};
+
+inline unsigned long make_tag(unsigned long block, slot_state s)
+{
+    return (block << 2) | static_cast<unsigned long>(s);
+}
+
+// waits until the slot holds block and its state satisfies pred, returns the state
+template<typename Predicate>
+slot_state wait_for_state(pipeline_slot& slot, unsigned long block, Predicate pred)
+{
+    unsigned long tag = slot.tag.load(std::memory_order_acquire);
+    while((tag >> 2) != block || !pred(static_cast<slot_state>(tag & 3)))
+    {
+        slot.tag.wait(tag, std::memory_order_acquire);
+        tag = slot.tag.load(std::memory_order_acquire);
+    }
+    return static_cast<slot_state>(tag & 3);
+}
+
+inline void set_state(pipeline_slot& slot, unsigned long block, slot_state s)
+{
+    slot.tag.store(make_tag(block, s), std::memory_order_release);
+    slot.tag.notify_all();
+}
+
+void process_data_pipelined(data_source &source, data_sink &sink, unsigned num_buffers = 3)
+{
+    if(num_buffers == 0)
+    {
+        throw std::invalid_argument("process_data_pipelined needs at least one buffer");
+    }
+    unsigned const concurrency = std::thread::hardware_concurrency();
+    unsigned const num_threads = (concurrency > 0) ? concurrency : 2;
+    std::vector<pipeline_slot> slots(num_buffers);
+    for(unsigned i = 0; i < num_buffers; ++i)
+    {
+        slots[i].tag.store(make_tag(i, slot_state::empty), std::memory_order_relaxed);    // slot i starts with block i
+    }
+
+    // joining_thread: the workers are declared last, so they are joined first
+    joining_thread reader([&] {
+        for(unsigned long k = 0;; ++k)
+        {
+            pipeline_slot& slot = slots[k % num_buffers];
+            wait_for_state(slot, k, [](slot_state s){return s == slot_state::empty;});
+            if(source.done())
+            {
+                set_state(slot, k, slot_state::end_of_data);
+                return;
+            }
+            data_block current_block = source.get_next_data_block();
+            slot.chunks = divide_into_chunks(current_block, num_threads);
+            slot.result = result_block();
+            slot.chunks_left.store(num_threads, std::memory_order_relaxed);
+            set_state(slot, k, slot_state::filled);
+        }
+    });
+
+    joining_thread writer([&] {
+        for(unsigned long k = 0;; ++k)
+        {
+            pipeline_slot& slot = slots[k % num_buffers];
+            if(wait_for_state(slot, k, [](slot_state s){return s == slot_state::processed || s == slot_state::end_of_data;})
+                == slot_state::end_of_data)
+            {
+                return;
+            }
+            sink.write_data(std::move(slot.result));
+            set_state(slot, k + num_buffers, slot_state::empty);    // the reader can reuse it for block k + num_buffers
+        }
+    });
+
+    std::vector<joining_thread> threads(num_threads);
+    for (unsigned i = 0; i < num_threads; ++i)
+    {
+        threads[i] = joining_thread([&, i] {
+            for(unsigned long k = 0;; ++k)
+            {
+                pipeline_slot& slot = slots[k % num_buffers];
+                if(wait_for_state(slot, k, [](slot_state s){return s == slot_state::filled || s == slot_state::end_of_data;})
+                    == slot_state::end_of_data)
+                {
+                    return;
+                }
+                slot.result.set_chunk(i, num_threads, process(slot.chunks[i]));
+                if(slot.chunks_left.fetch_sub(1, std::memory_order_acq_rel) == 1)   // last chunk of this block
+                {
+                    set_state(slot, k, slot_state::processed);
+                }
+            }
+        });
+    }
+}